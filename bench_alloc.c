@@ -0,0 +1,30 @@
+#include <stddef.h>
+
+// Linked into the benchmark build only.  Counts heap allocations made
+// by each thread, including those made inside noPoll and curl, by
+// standing in for glibc's malloc family.
+extern void *__libc_malloc( size_t size );
+extern void *__libc_calloc( size_t n, size_t size );
+extern void *__libc_realloc( void *ptr, size_t size );
+
+static __thread unsigned long allocations = 0;
+
+void *malloc( size_t size ) {
+    allocations++;
+    return __libc_malloc( size );
+}
+
+void *calloc( size_t n, size_t size ) {
+    allocations++;
+    return __libc_calloc( n, size );
+}
+
+void *realloc( void *ptr, size_t size ) {
+    allocations++;
+    return __libc_realloc( ptr, size );
+}
+
+// allocations made so far by the calling thread
+unsigned long bench_allocations( void ) {
+    return allocations;
+}
@@ -0,0 +1,84 @@
+#include "gcode.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+// Part of "make bench": checks that gcode_number() prints exactly what
+// "%.3f" does, then times the two against each other.
+#define CHECK_RANGE   1500.0      // +- MAX_FEED_RATE, which covers every distance too
+#define CHECK_RANDOM  1000000     // random values on top of the sweep
+#define TIME_VALUES   4096        // values cycled through when timing
+#define TIME_ROUNDS   1000
+
+static long mismatches = 0;
+
+static void check( double value ) {
+    char expect[GCODE_NUMBER_MAX], got[GCODE_NUMBER_MAX];
+
+    snprintf( expect, sizeof(expect), "%.3f", value );
+    gcode_number( got, value );
+    if (strcmp( expect, got ) && mismatches++ < 10) {
+        printf( "mismatch for %.17g: snprintf \"%s\", gcode_number \"%s\"\n", value, expect, got );
+    }
+}
+
+static double now_ns( void ) {
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main( void ) {
+    static double values[TIME_VALUES];
+    char buf[GCODE_NUMBER_MAX];
+    double start, snprintf_ns, gcode_ns;
+    long k, checked = 0, limit = CHECK_RANGE * 1000;
+    float f;
+    int i, r;
+    volatile int sink = 0;
+
+    // every thousandth and every halfway point, as the floats the
+    // jog code passes in and the float just either side of them
+    for (k = -2 * limit; k <= 2 * limit; k++) {
+        f = k / 2000.0f;
+        check( f );
+        check( nextafterf( f, -INFINITY ) );
+        check( nextafterf( f, INFINITY ) );
+        check( k / 2000.0 );
+        checked += 4;
+    }
+    srand( 1 );
+    for (k = 0; k < CHECK_RANDOM; k++) {
+        check( CHECK_RANGE * (2.0 * rand() / RAND_MAX - 1.0) );
+        checked++;
+    }
+    check( 0.0 );
+    check( -0.0 );
+    check( -0.0004 );
+    checked += 3;
+    printf( "gcode_number: %ld values checked, %ld differ from %%.3f\n", checked, mismatches );
+
+    for (i = 0; i < TIME_VALUES; i++) {
+        values[i] = (float)(CHECK_RANGE * (2.0 * rand() / RAND_MAX - 1.0));
+    }
+    start = now_ns();
+    for (r = 0; r < TIME_ROUNDS; r++) {
+        for (i = 0; i < TIME_VALUES; i++) {
+            sink += snprintf( buf, sizeof(buf), "%.3f", values[i] );
+        }
+    }
+    snprintf_ns = (now_ns() - start) / ((double)TIME_ROUNDS * TIME_VALUES);
+    start = now_ns();
+    for (r = 0; r < TIME_ROUNDS; r++) {
+        for (i = 0; i < TIME_VALUES; i++) {
+            sink += gcode_number( buf, values[i] );
+        }
+    }
+    gcode_ns = (now_ns() - start) / ((double)TIME_ROUNDS * TIME_VALUES);
+    printf( "snprintf %%.3f: %.1f ns, gcode_number: %.1f ns per number\n", snprintf_ns, gcode_ns );
+
+    return mismatches != 0;
+}
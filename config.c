@@ -0,0 +1,153 @@
+#include "config.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+
+
+// copy value into a fixed size setting, refusing it if it doesn't fit
+static int config_string( char *dst, size_t size, const char *value ) {
+    if (strlen( value ) >= size)
+        return 1;
+    strcpy( dst, value );
+    return 0;
+}
+
+static int config_number( double *dst, const char *value ) {
+    char *end;
+    double d = strtod( value, &end );
+
+    if (end == value || *end != '\0' || d <= 0)
+        return 1;
+    *dst = d;
+    return 0;
+}
+
+static int config_integer( int *dst, const char *value, int min ) {
+    char *end;
+    long n = strtol( value, &end, 10 );
+
+    if (end == value || *end != '\0' || n < min)
+        return 1;
+    *dst = n;
+    return 0;
+}
+
+static int config_flag( int *dst, const char *value ) {
+    if (!strcmp( value, "1" ) || !strcasecmp( value, "yes" ) || !strcasecmp( value, "true" )) {
+        *dst = 1;
+    } else if (!strcmp( value, "0" ) || !strcasecmp( value, "no" ) || !strcasecmp( value, "false" )) {
+        *dst = 0;
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+
+// Set one setting by name.  Returns 0, or 1 if the name is unknown or
+// the value doesn't make sense for it.
+int config_set( CONFIG *config, const char *key, const char *value ) {
+    int level;
+
+    if (!strcmp( key, "host" ))
+        return config_string( config->host, sizeof(config->host), value );
+    if (!strcmp( key, "port" ))
+        return config_string( config->port, sizeof(config->port), value );
+    if (!strcmp( key, "device_path" ))
+        return config_string( config->device_path, sizeof(config->device_path), value );
+    if (!strcmp( key, "publish_path" ))
+        return config_string( config->publish_path, sizeof(config->publish_path), value );
+    if (!strcmp( key, "metrics_port" ))
+        return config_string( config->metrics_port, sizeof(config->metrics_port), value );
+    if (!strcmp( key, "tinyg" ))
+        return config_flag( &config->tinyg, value );
+    if (!strcmp( key, "bcnc" ))
+        return config_flag( &config->bcnc, value );
+    if (!strcmp( key, "grbl_jog" ))
+        return config_flag( &config->grbl_jog, value );
+    if (!strcmp( key, "direct_serial" ))
+        return config_flag( &config->direct_serial, value );
+    if (!strcmp( key, "baud" ))
+        return config_integer( &config->baud, value, 1 );
+    if (!strcmp( key, "max_feed_rate" ))
+        return config_number( &config->max_feed_rate, value );
+    if (!strcmp( key, "overshoot" ))
+        return config_number( &config->overshoot, value );
+    if (!strncmp( key, "increment", 9 ) && key[9] >= '1' && key[9] < '1' + NUM_MOTION_SPEEDS && key[10] == '\0')
+        return config_number( &config->increments[key[9] - '1'], value );
+    if (!strcmp( key, "jog_accel" ))
+        return config_flag( &config->jog_accel, value );
+    if (!strcmp( key, "jog_accel_threshold" ))
+        return config_number( &config->jog_accel_threshold, value );
+    if (!strcmp( key, "jog_accel_gain" ))
+        return config_number( &config->jog_accel_gain, value );
+    if (!strcmp( key, "jog_accel_max" ))
+        return config_number( &config->jog_accel_max, value );
+    if (!strcmp( key, "realtime_priority" ))
+        return config_integer( &config->realtime_priority, value, 0 );
+    if (!strcmp( key, "cpu" ))
+        return config_integer( &config->cpu, value, 0 );
+    if (!strcmp( key, "log_level" )) {
+        level = log_parse_level( value );
+        if (level < 0)
+            return 1;
+        config->log_level = level;
+        return 0;
+    }
+    return 1;
+}
+
+
+// Read "key = value" lines from path.  Blank lines and anything after a
+// '#' are ignored.  A missing file is only an error if must_exist is set.
+// Returns 0, or 1 on any error.
+int config_load( CONFIG *config, const char *path, int must_exist ) {
+    char line[CONFIG_MAX_LINE];
+    char *key, *value, *end;
+    int line_no = 0, ret = 0;
+    FILE *f = fopen( path, "r" );
+
+    if (!f) {
+        if (errno == ENOENT && !must_exist)
+            return 0;
+        LOG_ERRNO( path );
+        return 1;
+    }
+
+    while (fgets( line, sizeof(line), f )) {
+        line_no++;
+        if ((end = strchr( line, '#' )) != NULL)
+            *end = '\0';
+        for (key = line; isspace( (unsigned char)*key ); key++)
+            ;
+        if (*key == '\0')
+            continue;
+
+        value = strchr( key, '=' );
+        if (!value) {
+            LOG_ERROR( "%s:%d: expected key = value", path, line_no );
+            ret = 1;
+            continue;
+        }
+        // trim the key and the value
+        for (end = value; end > key && isspace( (unsigned char)end[-1] ); end--)
+            ;
+        *end = '\0';
+        for (value++; isspace( (unsigned char)*value ); value++)
+            ;
+        for (end = value + strlen( value ); end > value && isspace( (unsigned char)end[-1] ); end--)
+            ;
+        *end = '\0';
+
+        if (config_set( config, key, value )) {
+            LOG_ERROR( "%s:%d: bad setting %s = %s", path, line_no, key, value );
+            ret = 1;
+        }
+    }
+    fclose( f );
+    return ret;
+}
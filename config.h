@@ -0,0 +1,38 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "shuttle.h"
+
+// Settings that can be changed without rebuilding.  The #defines at the
+// top of shuttlecp.c are the defaults; a config file and then the
+// command line override them.
+#define CONFIG_DEFAULT_PATH "/etc/shuttlecp.conf"
+#define CONFIG_MAX_LINE     256
+
+typedef struct {
+    char   host[256];                           // where SPJS or bCNC is running
+    char   port[16];
+    char   device_path[128];                    // serial port the controller is on
+    char   publish_path[108];                   // Unix socket the pendant state is published on, "" for none
+    char   metrics_port[16];                    // TCP port the Prometheus metrics are served on, "" for none
+    int    tinyg;                               // 1 for TinyG, 0 for GRBL
+    int    bcnc;                                // 1 for bCNC, 0 for SPJS/ChiliPeppr
+    int    grbl_jog;                            // 1 to shuttle with GRBL 1.1 $J= jogs
+    int    direct_serial;                       // 1 to drive device_path ourselves instead of through SPJS
+    int    baud;                                // its speed
+    double max_feed_rate;                       // units per minute at full shuttle
+    double overshoot;                           // shuttle segment overshoot factor
+    double increments[NUM_MOTION_SPEEDS];       // jog distance per click at each speed
+    int    jog_accel;                           // 1 to scale jog clicks by how fast the dial turns
+    double jog_accel_threshold;                 // clicks per second where acceleration starts
+    double jog_accel_gain;                      // extra increments per click for each threshold's worth above it
+    double jog_accel_max;                       // most increments one click may move
+    int    realtime_priority;                   // SCHED_FIFO priority for reading the jog controller, 0 for none
+    int    cpu;                                 // CPU to pin that to, -1 for any
+    int    log_level;
+} CONFIG;
+
+int config_set( CONFIG *config, const char *key, const char *value );
+int config_load( CONFIG *config, const char *path, int must_exist );
+
+#endif   /* CONFIG_H - do not put anything below this line! */
@@ -0,0 +1,66 @@
+#include "controller.h"
+#include "gcode.h"
+
+
+// "G91 G1 F<feed> <axis><distance>" and back to absolute mode
+void controller_g1_move( char *cmd, char axis, float feed, float distance ) {
+    char axis_str[3] = { ' ', axis, '\0' };
+    int len;
+
+    len = gcode_append( cmd, 0, MAX_CMD_LENGTH, "G91 G1 F" );
+    len = gcode_append_number( cmd, len, MAX_CMD_LENGTH, feed );
+    len = gcode_append( cmd, len, MAX_CMD_LENGTH, axis_str );
+    len = gcode_append_number( cmd, len, MAX_CMD_LENGTH, distance );
+    gcode_append( cmd, len, MAX_CMD_LENGTH, "\nG90\n" );
+}
+
+
+// "$J=G91 <axis><distance> F<feed>", a GRBL 1.1 jog.  Jogs leave the
+// modal state alone, so there is no G90 to go back to.
+void controller_jog_move( char *cmd, char axis, float feed, float distance ) {
+    char axis_str[2] = { axis, '\0' };
+    int len;
+
+    len = gcode_append( cmd, 0, MAX_CMD_LENGTH, "$J=G91 " );
+    len = gcode_append( cmd, len, MAX_CMD_LENGTH, axis_str );
+    len = gcode_append_number( cmd, len, MAX_CMD_LENGTH, distance );
+    len = gcode_append( cmd, len, MAX_CMD_LENGTH, " F" );
+    len = gcode_append_number( cmd, len, MAX_CMD_LENGTH, feed );
+    gcode_append( cmd, len, MAX_CMD_LENGTH, "\n" );
+}
+
+
+// GRBL has no way to drop what it has planned short of a reset, so the
+// segments are kept short and overlap a little, and a released shuttle
+// just runs out.
+const CONTROLLER_PROFILE controller_grbl = {
+    "GRBL",
+    controller_g1_move, 2, 1,
+    NULL, NULL, 0,
+    NULL,
+};
+
+// GRBL 1.1 decelerates and throws away every queued jog on the real-time
+// jog cancel (0x85).  It is UTF-8 encoded so that it can go out in a
+// websocket text frame; GRBL drops the unknown 0xc2 lead byte.  Lines SPJS
+// still holds would start the machine again once they reach GRBL, hence
+// the second cancel once they are gone.
+const CONTROLLER_PROFILE controller_grbl_jog = {
+    "GRBL 1.1 jogging",
+    controller_jog_move, 1, 0,
+    "\xc2\x85", NULL, 1,
+    NULL,
+};
+
+// TinyG and g2core stop with feedhold, flush the planner with '%' and
+// leave the hold with '~'.  The hold goes around the queue; the flush has
+// to go through SPJS's queue, because its TinyG buffer flow empties that
+// queue when it sees the '%'.  As that stops the machine at once, the
+// segments don't overlap.  JSON mode with single line queue reports
+// ({"qr":N} after every change) lets the planner pace the segments.
+const CONTROLLER_PROFILE controller_tinyg = {
+    "TinyG",
+    controller_g1_move, 2, 0,
+    "!", "%\n~\n", 0,
+    "{\"ej\":1}\n{\"qv\":1}\n",
+};
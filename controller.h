@@ -0,0 +1,32 @@
+#ifndef CONTROLLER_H
+#define CONTROLLER_H
+
+#include "websocket.h"
+
+// What differs between the motion controllers we drive: how a shuttle
+// segment is written, how a shuttle move is stopped when the wheel is
+// released, and what the controller has to be told once it can be
+// reached.  The rest of shuttlecp only goes through the profile.
+
+// Builds one shuttle segment, distance along axis at feed
+typedef void (*CONTROLLER_MOVE)( char *cmd, char axis, float feed, float distance );
+
+typedef struct {
+    const char      *name;
+    CONTROLLER_MOVE shuttle_move;
+    int             move_lines;         // lines of each shuttle_move(), each acknowledged
+    int             overshoot;          // segments overlap (OVERSHOOT), as nothing stops them early
+    const char      *stop_realtime;     // sent around the queue on release, NULL for none
+    const char      *stop_lines;        // and then queued behind it, NULL for none
+    int             stop_after_drain;   // send stop_realtime again once our output and SPJS's queue have drained
+    const char      *connect_lines;     // queued whenever the connection (re)starts, NULL for none
+} CONTROLLER_PROFILE;
+
+extern const CONTROLLER_PROFILE controller_grbl;       // G91 G1 segments
+extern const CONTROLLER_PROFILE controller_grbl_jog;   // GRBL 1.1 $J= jogs and jog cancel
+extern const CONTROLLER_PROFILE controller_tinyg;      // TinyG / g2core in JSON mode
+
+void controller_g1_move( char *cmd, char axis, float feed, float distance );
+void controller_jog_move( char *cmd, char axis, float feed, float distance );
+
+#endif   /* CONTROLLER_H - do not put anything below this line! */
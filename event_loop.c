@@ -0,0 +1,173 @@
+#include "event_loop.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/timerfd.h>
+
+
+// Each registered fd carries its slot index and its own value in the
+// epoll data word, so a handler that removes another source during the
+// same dispatch round can't cause a stale event to be delivered.
+static uint64_t pack_source( int slot, int fd ) {
+    return ((uint64_t)slot << 32) | (uint32_t)fd;
+}
+
+static EVENT_SOURCE *find_source( EVENT_LOOP *loop, int fd ) {
+    int i;
+    for (i = 0; i < MAX_EVENT_SOURCES; i++) {
+        if (loop->sources[i].fd == fd)
+            return &loop->sources[i];
+    }
+    return NULL;
+}
+
+
+// create the epoll instance and mark all the source slots free
+int event_loop_init( EVENT_LOOP *loop ) {
+    int i;
+
+    for (i = 0; i < MAX_EVENT_SOURCES; i++) {
+        loop->sources[i].fd = -1;
+    }
+    loop->epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+    if (loop->epoll_fd < 0) {
+        LOG_ERRNO( "epoll_create1" );
+        return 1;
+    }
+    return 0;
+}
+
+
+// start watching fd for the given epoll events
+int event_loop_add( EVENT_LOOP *loop, int fd, unsigned int events, EVENT_HANDLER handler, void *data ) {
+    struct epoll_event ev;
+    EVENT_SOURCE *src;
+
+    src = find_source( loop, -1 );
+    if (src == NULL) {
+        LOG_ERROR( "No free event loop slot for fd %d", fd );
+        return 1;
+    }
+
+    memset( &ev, 0, sizeof(ev) );
+    ev.events   = events;
+    ev.data.u64 = pack_source( src - loop->sources, fd );
+    if (epoll_ctl( loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev ) < 0) {
+        LOG_ERRNO( "epoll_ctl add" );
+        return 1;
+    }
+
+    src->fd      = fd;
+    src->handler = handler;
+    src->data    = data;
+    return 0;
+}
+
+
+// change the set of events we are waiting for on fd
+int event_loop_modify( EVENT_LOOP *loop, int fd, unsigned int events ) {
+    struct epoll_event ev;
+    EVENT_SOURCE *src;
+
+    src = find_source( loop, fd );
+    if (src == NULL)
+        return 1;
+
+    memset( &ev, 0, sizeof(ev) );
+    ev.events   = events;
+    ev.data.u64 = pack_source( src - loop->sources, fd );
+    if (epoll_ctl( loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev ) < 0) {
+        LOG_ERRNO( "epoll_ctl mod" );
+        return 1;
+    }
+    return 0;
+}
+
+
+// stop watching fd.  The caller still owns the descriptor and closes it.
+void event_loop_remove( EVENT_LOOP *loop, int fd ) {
+    EVENT_SOURCE *src;
+
+    if (fd < 0)
+        return;
+    src = find_source( loop, fd );
+    if (src == NULL)
+        return;
+
+    epoll_ctl( loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL );
+    src->fd = -1;
+}
+
+
+// Block until at least one source is ready (or timeout_ms expires,
+// -1 waits forever) and dispatch each ready source to its handler.
+// Returns the number of events dispatched, or -1 on error.
+int event_loop_run_once( EVENT_LOOP *loop, int timeout_ms ) {
+    struct epoll_event events[MAX_EVENT_SOURCES];
+    EVENT_SOURCE *src;
+    int i, n, slot, fd;
+
+    n = epoll_wait( loop->epoll_fd, events, MAX_EVENT_SOURCES, timeout_ms );
+    if (n < 0) {
+        if (errno == EINTR)
+            return 0;
+        LOG_ERRNO( "epoll_wait" );
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        slot = (int)(events[i].data.u64 >> 32);
+        fd   = (int)(uint32_t)events[i].data.u64;
+        src  = &loop->sources[slot];
+        if (src->fd != fd)      // removed earlier in this round
+            continue;
+        src->handler( fd, events[i].events, src->data );
+    }
+    return n;
+}
+
+
+// create a non-blocking monotonic timerfd, initially disarmed
+int timer_new( void ) {
+    int timer_fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+    if (timer_fd < 0) {
+        LOG_ERRNO( "timerfd_create" );
+    }
+    return timer_fd;
+}
+
+
+// (re)start a periodic timer, with the first expiry one interval from now
+void timer_set( int timer_fd, long interval_us ) {
+    struct itimerspec spec;
+
+    spec.it_interval.tv_sec  = interval_us / 1000000;
+    spec.it_interval.tv_nsec = (interval_us % 1000000) * 1000;
+    spec.it_value            = spec.it_interval;
+    timerfd_settime( timer_fd, 0, &spec, NULL );
+}
+
+
+// arm a timer to expire once, delay_us from now
+void timer_once( int timer_fd, long delay_us ) {
+    struct itimerspec spec;
+
+    spec.it_interval.tv_sec  = 0;
+    spec.it_interval.tv_nsec = 0;
+    spec.it_value.tv_sec     = delay_us / 1000000;
+    spec.it_value.tv_nsec    = (delay_us % 1000000) * 1000;
+    timerfd_settime( timer_fd, 0, &spec, NULL );
+}
+
+
+// consume the expiry count so the timer stops reporting readable
+unsigned long long timer_ack( int timer_fd ) {
+    unsigned long long expirations = 0;
+
+    if (read( timer_fd, &expirations, sizeof(expirations) ) != sizeof(expirations))
+        return 0;
+    return expirations;
+}
@@ -0,0 +1,35 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <sys/epoll.h>
+
+// Maximum number of file descriptors that can be watched by one loop
+#define MAX_EVENT_SOURCES 48
+
+// Called with the fd that became ready and the epoll event mask
+typedef void (*EVENT_HANDLER)( int fd, unsigned int events, void *data );
+
+typedef struct {
+    int           fd;          // -1 when the slot is free
+    EVENT_HANDLER handler;
+    void          *data;
+} EVENT_SOURCE;
+
+typedef struct {
+    int          epoll_fd;
+    EVENT_SOURCE sources[MAX_EVENT_SOURCES];
+} EVENT_LOOP;
+
+int  event_loop_init( EVENT_LOOP *loop );
+int  event_loop_add( EVENT_LOOP *loop, int fd, unsigned int events, EVENT_HANDLER handler, void *data );
+int  event_loop_modify( EVENT_LOOP *loop, int fd, unsigned int events );
+void event_loop_remove( EVENT_LOOP *loop, int fd );
+int  event_loop_run_once( EVENT_LOOP *loop, int timeout_ms );
+
+// timerfd helpers.  An interval of zero disarms the timer.
+int  timer_new( void );
+void timer_set( int timer_fd, long interval_us );
+void timer_once( int timer_fd, long delay_us );
+unsigned long long timer_ack( int timer_fd );
+
+#endif   /* EVENT_LOOP_H - do not put anything below this line! */
@@ -0,0 +1,84 @@
+#include "gcode.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+// How close to halfway between two thousandths a value may be before
+// we let snprintf decide.  value * 1000 is off by at most half an ulp,
+// which stays well below this up to GCODE_FAST_LIMIT, so outside the
+// margin the integer rounding always agrees with the exact decimal one.
+#define GCODE_TIE_MARGIN 1e-3
+
+
+// Print value with three decimals into buf, which must hold at least
+// GCODE_NUMBER_MAX bytes.  Returns the length, like snprintf.
+int gcode_number( char *buf, double value ) {
+    char digits[GCODE_NUMBER_MAX];
+    double scaled = value * 1000.0;
+    double frac;
+    unsigned long long n;
+    unsigned int whole;
+    int len = 0, i = 0;
+
+    if (signbit( value )) {
+        scaled = -scaled;
+    }
+    // also catches NaN
+    if (!(scaled < GCODE_FAST_LIMIT)) {
+        return snprintf( buf, GCODE_NUMBER_MAX, "%.3f", value );
+    }
+    n    = (unsigned long long)scaled;
+    frac = scaled - n;                  // exact
+    if (frac > 0.5 - GCODE_TIE_MARGIN && frac < 0.5 + GCODE_TIE_MARGIN) {
+        return snprintf( buf, GCODE_NUMBER_MAX, "%.3f", value );
+    }
+    if (frac > 0.5) {
+        n++;
+    }
+
+    // "%.3f" keeps the sign of values that round to zero, "-0.000"
+    if (signbit( value )) {
+        buf[len++] = '-';
+    }
+    // three decimals, then the whole part, built backwards
+    whole = n % 1000;
+    digits[i++] = '0' + whole % 10;
+    digits[i++] = '0' + whole / 10 % 10;
+    digits[i++] = '0' + whole / 100;
+    digits[i++] = '.';
+    n /= 1000;
+    do {
+        digits[i++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    while (i) {
+        buf[len++] = digits[--i];
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+
+// Append text to the command in cmd[0..len) of size bytes.  Returns the
+// new length; anything that doesn't fit is cut off.
+int gcode_append( char *cmd, int len, int size, const char *text ) {
+    int n = strlen( text );
+
+    if (n > size - 1 - len)
+        n = size - 1 - len;
+    memcpy( cmd + len, text, n );
+    len += n;
+    cmd[len] = '\0';
+    return len;
+}
+
+
+// As gcode_append(), for a number printed by gcode_number()
+int gcode_append_number( char *cmd, int len, int size, double value ) {
+    char number[GCODE_NUMBER_MAX];
+
+    if (size - len >= GCODE_NUMBER_MAX)
+        return len + gcode_number( cmd + len, value );
+    gcode_number( number, value );
+    return gcode_append( cmd, len, size, number );
+}
@@ -0,0 +1,14 @@
+#ifndef GCODE_H
+#define GCODE_H
+
+// Building G-code without snprintf.  Numbers are printed the way "%.3f"
+// prints them, byte for byte, from an integer count of thousandths, so
+// the float formatting code (and its locale) stays out of the path.
+#define GCODE_NUMBER_MAX   24            // room gcode_number() needs, with the NUL
+#define GCODE_FAST_LIMIT   1e12          // thousandths; anything bigger goes to snprintf
+
+int gcode_number( char *buf, double value );
+int gcode_append( char *cmd, int len, int size, const char *text );
+int gcode_append_number( char *cmd, int len, int size, double value );
+
+#endif   /* GCODE_H - do not put anything below this line! */
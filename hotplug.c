@@ -0,0 +1,61 @@
+#include "hotplug.h"
+#include "log.h"
+
+#if UDEV_SUPPORT
+#include <string.h>
+#include <libudev.h>
+
+static struct udev         *udev    = NULL;
+static struct udev_monitor *monitor = NULL;
+static HOTPLUG_HANDLER     hotplug_handler;
+
+
+// event loop handler for the udev monitor socket, which is non-blocking
+static void hotplug_event( int fd, unsigned int events, void *data ) {
+    struct udev_device *dev;
+    const char *action, *devnode;
+
+    (void)fd;
+    (void)events;
+    (void)data;
+    while ((dev = udev_monitor_receive_device( monitor )) != NULL) {
+        action  = udev_device_get_action( dev );
+        devnode = udev_device_get_devnode( dev );
+        if (action && devnode && strcmp( action, "add" ) == 0) {
+            LOG_DEBUG( "udev: %s added", devnode );
+            hotplug_handler( devnode );
+        }
+        udev_device_unref( dev );
+    }
+}
+
+
+// Start listening for input devices being added.  Returns 0, or 1 if
+// udev isn't available.
+int hotplug_init( EVENT_LOOP *loop, HOTPLUG_HANDLER handler ) {
+    hotplug_handler = handler;
+    udev = udev_new();
+    if (!udev) {
+        LOG_ERROR( "udev_new failed" );
+        return 1;
+    }
+    // "udev" rather than "kernel" events, so the rules have been applied
+    monitor = udev_monitor_new_from_netlink( udev, "udev" );
+    if (!monitor ||
+        udev_monitor_filter_add_match_subsystem_devtype( monitor, "input", NULL ) < 0 ||
+        udev_monitor_enable_receiving( monitor ) < 0) {
+        LOG_ERROR( "Could not set up the udev monitor" );
+        return 1;
+    }
+    return event_loop_add( loop, udev_monitor_get_fd( monitor ), EPOLLIN, hotplug_event, NULL );
+}
+
+#else
+
+int hotplug_init( EVENT_LOOP *loop, HOTPLUG_HANDLER handler ) {
+    (void)loop;
+    (void)handler;
+    return 0;
+}
+
+#endif
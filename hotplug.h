@@ -0,0 +1,18 @@
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include "event_loop.h"
+
+// Hearing about jog controllers being plugged in.  With UDEV_SUPPORT
+// the udev monitor socket is watched by the event loop and the handler
+// runs as soon as udev has set up a new input device node (and the
+// links and permissions from the 99-Shuttle*.rules files).  Without
+// it hotplug_init() does nothing and the caller's retry timer is all
+// there is.
+
+// Called with the device node of each input device that appears
+typedef void (*HOTPLUG_HANDLER)( const char *devnode );
+
+int hotplug_init( EVENT_LOOP *loop, HOTPLUG_HANDLER handler );
+
+#endif   /* HOTPLUG_H - do not put anything below this line! */
@@ -0,0 +1,280 @@
+#include "http.h"
+#include "log.h"
+#include <ctype.h>
+
+// bCNC transport.  A single easy handle is reused for every request, so
+// the multi handle's connection cache keeps the TCP connection to bCNC
+// alive between them.  Requests are driven by the event loop through
+// curl's socket interface, so a slow bCNC response never blocks reading
+// the ShuttleXpress.  Only one request is in flight at a time to keep
+// the moves in order; anything queued meanwhile goes out in the next one.
+
+static CURLM*      multi     = NULL;
+static CURL*       easy      = NULL;
+static EVENT_LOOP* http_loop = NULL;
+static int         http_timer_fd = -1;
+static int         in_flight = 0;        // commands carried by the current request
+static int         realtime  = 0;        // the current request is a real-time command
+static struct timespec realtime_start;   // when its switch press was noticed
+static long long   event_us[QUEUE_CAPACITY];   // timestamps of the commands in flight
+static long long   queued_us[QUEUE_CAPACITY];
+static char        url[HTTP_MAX_URL];
+static int         url_prefix_len;      // "http://host:port/send?gcode=", built once
+
+
+// read the outcome of finished requests
+static void http_check_done() {
+    CURLMsg* msg;
+    int i, msgs_left;
+    struct timespec now;
+    long long now_us;
+    long latency_us;
+
+    while ((msg = curl_multi_info_read( multi, &msgs_left )) != NULL) {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+        if (msg->data.result != CURLE_OK) {
+            LOG_ERROR( "curl request failed: %s %s",
+                    curl_easy_strerror( msg->data.result ), url);
+            stats_count( STATS_CMDS_FAILED, in_flight );
+        } else if (realtime) {
+            clock_gettime( CLOCK_MONOTONIC, &now );
+            latency_us = (now.tv_sec - realtime_start.tv_sec) * 1000000L +
+                         (now.tv_nsec - realtime_start.tv_nsec) / 1000;
+            LOG_INFO( "Real-time command accepted by bCNC %ld us after the switch", latency_us );
+            stats_record( STATS_REALTIME_TO_WIRE, latency_us );
+        } else {
+            LOG_DEBUG( "     + Successfully sent %d cmds: %s", in_flight, url );
+            stats_count( STATS_CMDS_SENT, in_flight );
+            // bCNC has the commands once it has answered
+            now_us = stats_now_us();
+            for (i = 0; i < in_flight; i++) {
+                stats_record( STATS_QUEUE_TO_WIRE, now_us - queued_us[i] );
+                if (event_us[i]) {
+                    stats_record( STATS_EVENT_TO_WIRE, now_us - event_us[i] );
+                }
+            }
+        }
+        realtime = 0;
+        curl_multi_remove_handle( multi, msg->easy_handle );
+        in_flight = 0;
+    }
+}
+
+// event loop handler for the sockets curl asks us to watch
+static void http_socket_event( int fd, unsigned int events, void* data ) {
+    int running;
+    int flags = 0;
+
+    (void)data;
+    if (events & EPOLLIN)                flags |= CURL_CSELECT_IN;
+    if (events & EPOLLOUT)               flags |= CURL_CSELECT_OUT;
+    if (events & (EPOLLERR | EPOLLHUP))  flags |= CURL_CSELECT_ERR;
+    curl_multi_socket_action( multi, fd, flags, &running );
+    http_check_done();
+}
+
+// event loop handler for curl's timeouts
+static void http_timer_event( int fd, unsigned int events, void* data ) {
+    int running;
+
+    (void)events;
+    (void)data;
+    timer_ack( fd );
+    curl_multi_socket_action( multi, CURL_SOCKET_TIMEOUT, 0, &running );
+    http_check_done();
+}
+
+// curl telling us which sockets to watch for what
+static int http_socket_cb( CURL* e, curl_socket_t s, int what, void* userp, void* socketp ) {
+    unsigned int events = 0;
+
+    (void)e;
+    (void)userp;
+    if (what == CURL_POLL_REMOVE) {
+        event_loop_remove( http_loop, s );
+        curl_multi_assign( multi, s, NULL );
+        return 0;
+    }
+    if (what & CURL_POLL_IN)  events |= EPOLLIN;
+    if (what & CURL_POLL_OUT) events |= EPOLLOUT;
+
+    if (socketp == NULL) {
+        if (event_loop_add( http_loop, s, events, http_socket_event, NULL ))
+            return -1;
+        curl_multi_assign( multi, s, (void*)1 );
+    } else {
+        event_loop_modify( http_loop, s, events );
+    }
+    return 0;
+}
+
+// curl telling us when it next needs to be called, -1 for never
+static int http_timer_cb( CURLM* m, long timeout_ms, void* userp ) {
+    (void)m;
+    (void)userp;
+    if (timeout_ms < 0) {
+        timer_once( http_timer_fd, 0 );
+    } else {
+        // a zero delay would disarm the timer, so round up to 1us
+        timer_once( http_timer_fd, timeout_ms > 0 ? timeout_ms * 1000 : 1 );
+    }
+    return 0;
+}
+
+// bCNC's reply is of no interest to us, don't let curl print it
+static size_t http_discard( char* ptr, size_t size, size_t nmemb, void* userp ) {
+    (void)ptr;
+    (void)userp;
+    return size * nmemb;
+}
+
+
+// Set up the long lived curl handles and hook them into the event loop
+int http_init( EVENT_LOOP* loop, const char* host, const char* port ) {
+    http_loop = loop;
+    url_prefix_len = snprintf( url, sizeof(url), "http://%s:%s/send?gcode=", host, port );
+    if (url_prefix_len >= HTTP_MAX_URL / 2) {
+        LOG_ERROR( "bCNC host name too long: %s", host );
+        return 1;
+    }
+
+    curl_global_init( CURL_GLOBAL_DEFAULT );
+    multi = curl_multi_init();
+    easy  = curl_easy_init();
+    if (!multi || !easy) {
+        LOG_ERROR( "Failed to establish curl instance" );
+        return 1;
+    }
+
+    http_timer_fd = timer_new();
+    if (http_timer_fd < 0 ||
+        event_loop_add( loop, http_timer_fd, EPOLLIN, http_timer_event, NULL )) {
+        return 1;
+    }
+
+    curl_multi_setopt( multi, CURLMOPT_SOCKETFUNCTION, http_socket_cb );
+    curl_multi_setopt( multi, CURLMOPT_TIMERFUNCTION,  http_timer_cb );
+
+    curl_easy_setopt( easy, CURLOPT_TCP_KEEPALIVE, 1L );
+    curl_easy_setopt( easy, CURLOPT_TCP_NODELAY,   1L );
+    curl_easy_setopt( easy, CURLOPT_TIMEOUT_MS,    (long)HTTP_TIMEOUT_MS );
+    curl_easy_setopt( easy, CURLOPT_NOSIGNAL,      1L );
+    curl_easy_setopt( easy, CURLOPT_WRITEFUNCTION, http_discard );
+    return 0;
+}
+
+
+// True while a request is still on its way to bCNC
+int http_busy() {
+    return in_flight > 0;
+}
+
+
+// Turn queued G-code into a bCNC "send" URL.  bCNC takes its lines
+// separated by %0D, and we leave out the spaces.  Plain G-code needs no
+// other escaping, but controller commands such as TinyG's "%" flush do.
+// Returns the new length, or -1 if it doesn't fit.
+static int http_append_gcode( int len, const char* gcode ) {
+    for (; *gcode; gcode++) {
+        if (len >= HTTP_MAX_URL - 4)
+            return -1;
+        if (*gcode == ' ')
+            continue;
+        if (*gcode == '\n') {
+            len += sprintf( url + len, "%%0D" );
+        } else if (isalnum( (unsigned char)*gcode ) || strchr( ".-_~$=!", *gcode )) {
+            url[len++] = *gcode;
+        } else {
+            len += sprintf( url + len, "%%%02X", (unsigned char)*gcode );
+        }
+    }
+    return len;
+}
+
+
+// Finish off the URL built in url[0..len) and start the request for it.
+// Returns the number of commands it carries.
+static int http_start( int len, int num_cmds ) {
+    // drop the trailing line separator
+    if (len >= 3 && memcmp( url + len - 3, "%0D", 3 ) == 0)
+        len -= 3;
+    url[len] = '\0';
+
+    curl_easy_setopt( easy, CURLOPT_URL, url );
+    if (curl_multi_add_handle( multi, easy ) != CURLM_OK) {
+        LOG_ERROR( "Failed to start curl request: %s", url );
+        return 0;
+    }
+    in_flight = num_cmds;
+    LOG_DEBUG( "Sent %d commands", num_cmds );
+    return num_cmds;
+}
+
+
+// Start one request carrying all the G-code in the queue (or as much as
+// fits in a URL).  Returns the number of commands it carries.
+int http_send_cmds( Queue* queue ) {
+    char cmd[MAX_CMD_LENGTH];
+    CMD_TYPE type;
+    int len, next_len, num_cmds = 0;
+
+    if (queue->size == 0 || http_busy())
+        return 0;
+
+    // url always starts with the prefix, only the G-code changes
+    len = url_prefix_len;
+    while (queue->size > 0) {
+        queue->peek( queue, &type, cmd );
+        if (type != CMD_GCODE) {
+            queue->pop( queue, &type, cmd );    // bCNC has nobody to broadcast to
+            continue;
+        }
+        next_len = http_append_gcode( len, cmd );
+        if (next_len < 0 && num_cmds > 0)
+            break;                              // the rest goes in the next request
+        event_us[num_cmds]  = queue->at( queue, 0 )->event_us;
+        queued_us[num_cmds] = queue->at( queue, 0 )->queued_us;
+        queue->pop( queue, &type, cmd );
+        if (next_len < 0) {
+            LOG_ERROR( "Command too long for bCNC: %s", cmd );
+            stats_count( STATS_CMDS_FAILED, 1 );
+            continue;
+        }
+        len = next_len;
+        num_cmds++;
+    }
+    if (num_cmds == 0)
+        return 0;
+
+    return http_start( len, num_cmds );
+}
+
+
+// Send a real-time command (feed hold, resume, reset) straight away.
+// bCNC has nothing like SPJS's unbuffered send, so the best we can do
+// is to abandon a request still in flight rather than wait behind it.
+int http_send_realtime( const char* gcode, const struct timespec* detected ) {
+    int len;
+
+    http_reset();
+    len = http_append_gcode( url_prefix_len, gcode );
+    if (len < 0 || http_start( len, 1 ) != 1)
+        return -1;
+    realtime = 1;
+    realtime_start = *detected;
+    return 0;
+}
+
+
+// abandon any request in flight, e.g. when reconnecting
+void http_reset() {
+    if (in_flight) {
+        if (!realtime) {
+            stats_count( STATS_CMDS_FAILED, in_flight );
+        }
+        curl_multi_remove_handle( multi, easy );
+        in_flight = 0;
+    }
+    realtime = 0;
+}
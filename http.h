@@ -0,0 +1,18 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <curl/curl.h>
+#include <time.h>
+#include "websocket.h"
+#include "event_loop.h"
+
+#define HTTP_MAX_URL        1024      // longest batched bCNC request we build
+#define HTTP_TIMEOUT_MS     2000      // give up on a bCNC request after this long
+
+int  http_init( EVENT_LOOP* loop, const char* host, const char* port );
+int  http_busy();
+int  http_send_cmds( Queue* queue );
+int  http_send_realtime( const char* gcode, const struct timespec* detected );
+void http_reset();
+
+#endif   /* HTTP_H - do not put anything below this line! */
@@ -0,0 +1,65 @@
+#include "input_queue.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+
+// set up an empty queue and the eventfd used to wake the consumer
+int input_queue_init( INPUT_QUEUE *q ) {
+    atomic_init( &q->head, 0 );
+    atomic_init( &q->tail, 0 );
+    q->wake_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if (q->wake_fd < 0) {
+        LOG_ERRNO( "eventfd" );
+        return 1;
+    }
+    return 0;
+}
+
+
+// Producer side: copy msg into the ring and wake the consumer.
+// Returns -1 (and copies nothing) if the ring is full.
+int input_queue_push( INPUT_QUEUE *q, const INPUT_MSG *msg ) {
+    unsigned int tail = atomic_load_explicit( &q->tail, memory_order_relaxed );
+    unsigned int head = atomic_load_explicit( &q->head, memory_order_acquire );
+    uint64_t one = 1;
+
+    if (tail - head == INPUT_QUEUE_CAPACITY)
+        return -1;
+
+    q->slots[tail & (INPUT_QUEUE_CAPACITY - 1)] = *msg;
+    atomic_store_explicit( &q->tail, tail + 1, memory_order_release );
+
+    if (write( q->wake_fd, &one, sizeof(one) ) != sizeof(one)) {
+        // only fails if the counter would overflow, and then the
+        // consumer is already due to wake up
+    }
+    return 0;
+}
+
+
+// Consumer side: take the oldest message.  Returns -1 if it is empty.
+int input_queue_pop( INPUT_QUEUE *q, INPUT_MSG *msg ) {
+    unsigned int head = atomic_load_explicit( &q->head, memory_order_relaxed );
+    unsigned int tail = atomic_load_explicit( &q->tail, memory_order_acquire );
+
+    if (head == tail)
+        return -1;
+
+    *msg = q->slots[head & (INPUT_QUEUE_CAPACITY - 1)];
+    atomic_store_explicit( &q->head, head + 1, memory_order_release );
+    return 0;
+}
+
+
+// Consumer side: reset the eventfd before draining the ring, so a push
+// that lands while we drain wakes us again.
+void input_queue_ack( INPUT_QUEUE *q ) {
+    uint64_t count;
+
+    if (read( q->wake_fd, &count, sizeof(count) ) != sizeof(count)) {
+        // nothing pending, or EAGAIN
+    }
+}
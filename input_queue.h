@@ -0,0 +1,43 @@
+#ifndef INPUT_QUEUE_H
+#define INPUT_QUEUE_H
+
+#include <stdatomic.h>
+#include <linux/input.h>
+#include "raspi_switches.h"
+
+// Messages from the input thread to the thread that owns the transport
+#define INPUT_QUEUE_CAPACITY 256         // messages, must be a power of two
+
+typedef enum {
+    INPUT_EVENT            = 0,   // an event read from the jog controller
+    INPUT_SWITCHES         = 1,   // the Raspberry Pi switches changed
+    INPUT_DEVICE_CONNECTED = 2,   // the jog controller was opened
+    INPUT_DEVICE_LOST      = 3,   // reading the jog controller failed
+    INPUT_WAKEUP_LATE      = 4,   // a jitter probe sample, for the stats
+} INPUT_MSG_TYPE;
+
+typedef struct {
+    INPUT_MSG_TYPE     type;
+    int                device;           // index of the jog controller it is about
+    struct input_event ev;
+    SWITCH_STATES      switches;
+    long long          late_us;          // INPUT_WAKEUP_LATE only
+} INPUT_MSG;
+
+// A lock-free single producer / single consumer ring.  Only the input
+// thread pushes and only the transport thread pops; each side owns one
+// index and publishes it to the other with release/acquire ordering.
+// The eventfd wakes the consumer's event loop.
+typedef struct {
+    INPUT_MSG   slots[INPUT_QUEUE_CAPACITY];
+    atomic_uint head;                    // next slot to pop, written by the consumer
+    atomic_uint tail;                    // next slot to push, written by the producer
+    int         wake_fd;
+} INPUT_QUEUE;
+
+int  input_queue_init( INPUT_QUEUE *q );
+int  input_queue_push( INPUT_QUEUE *q, const INPUT_MSG *msg );
+int  input_queue_pop( INPUT_QUEUE *q, INPUT_MSG *msg );
+void input_queue_ack( INPUT_QUEUE *q );
+
+#endif   /* INPUT_QUEUE_H - do not put anything below this line! */
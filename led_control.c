@@ -4,64 +4,110 @@
 #include <wiringPi.h>
 
 
+// pin for each LED_BIT, lowest bit first
+static const int led_pins[LED_COUNT] = {
+    LED_ONLINE,
+    LED_WEBSOCKET_CONNECTED,
+    LED_X_AXIS_ACTIVE,
+    LED_Y_AXIS_ACTIVE,
+    LED_Z_AXIS_ACTIVE,
+    LED_A_AXIS_ACTIVE,
+    LED_MOTION_SPEED_1,
+    LED_MOTION_SPEED_2,
+    LED_MOTION_SPEED_3,
+    LED_MOTION_SPEED_4,
+};
+
+
 // initialize the led states structure and the hardware
 void initialize_led_states( LED_STATES *states ) {
-    states->online               = 0;
-    states->websocket_connected  = 0;
-    states->x_axis_active  = 0;
-    states->y_axis_active  = 0;
-    states->z_axis_active  = 0;
-    states->a_axis_active  = 0;
-    states->motion_speed_1  = 0;
-    states->motion_speed_2  = 0;
-    states->motion_speed_3  = 0;
-    states->motion_speed_4  = 0;
+    int i;
+
+    states->bits          = 0;
+    states->written       = 0;
+    states->written_valid = 0;
 
     // also initilize the LED pins to be output
-    pinMode( LED_ONLINE,              OUTPUT );
-    pinMode( LED_WEBSOCKET_CONNECTED, OUTPUT );
-    pinMode( LED_X_AXIS_ACTIVE,       OUTPUT );
-    pinMode( LED_Y_AXIS_ACTIVE,       OUTPUT );
-    pinMode( LED_Z_AXIS_ACTIVE,       OUTPUT );
-    pinMode( LED_A_AXIS_ACTIVE,       OUTPUT );
-    pinMode( LED_MOTION_SPEED_1,      OUTPUT );
-    pinMode( LED_MOTION_SPEED_2,      OUTPUT );
-    pinMode( LED_MOTION_SPEED_3,      OUTPUT );
-    pinMode( LED_MOTION_SPEED_4,      OUTPUT );
+    for (i = 0; i < LED_COUNT; i++) {
+        pinMode( led_pins[i], OUTPUT );
+    }
     return;
 }
 
 
+// LED_BIT for each axis and speed.  B and C have no LED of their own.
+static const unsigned int axis_led_bits[NUM_AXES] = {
+    LED_BIT_X_AXIS_ACTIVE,
+    LED_BIT_Y_AXIS_ACTIVE,
+    LED_BIT_Z_AXIS_ACTIVE,
+    LED_BIT_A_AXIS_ACTIVE,
+    0,
+    0,
+};
+static const unsigned int speed_led_bits[NUM_MOTION_SPEEDS] = {
+    LED_BIT_MOTION_SPEED_1,
+    LED_BIT_MOTION_SPEED_2,
+    LED_BIT_MOTION_SPEED_3,
+    LED_BIT_MOTION_SPEED_4,
+};
+
+
 // update the led states structure to match current program state
 void update_led_states( LED_STATES *states, short dev_connected, short ws_connected, ACTIVE_AXIS axis, ACTIVE_SPEED speed ) {
-    states->online               = (dev_connected != 0);
-    states->websocket_connected  = (ws_connected != 0);
-    states->x_axis_active        = (axis == X_AXIS_ACTIVE);
-    states->y_axis_active        = (axis == Y_AXIS_ACTIVE);
-    states->z_axis_active        = (axis == Z_AXIS_ACTIVE);
-    states->a_axis_active        = (axis == A_AXIS_ACTIVE);
-    states->motion_speed_1       = (speed == MOTION_SPEED_1);
-    states->motion_speed_2       = (speed == MOTION_SPEED_2);
-    states->motion_speed_3       = (speed == MOTION_SPEED_3);
-    states->motion_speed_4       = (speed == MOTION_SPEED_4);
+    unsigned int bits = 0;
+
+    if (dev_connected)               bits |= LED_BIT_ONLINE;
+    if (ws_connected)                bits |= LED_BIT_WEBSOCKET_CONNECTED;
+    bits |= axis_led_bits[axis] | speed_led_bits[speed];
+    states->bits = bits;
 }
 
 
-// drive out LED states
+// drive out LED states.  Only the pins whose LED changed since the last
+// call are written, so this costs nothing while nothing changes.
 void drive_leds( LED_STATES *states ) {
+    unsigned int changed = states->bits ^ states->written;
+    int i;
+#if LED_BANK_WRITE
+    int bank = 0;
+#endif
+
+    if (!states->written_valid) {
+        changed = (1u << LED_COUNT) - 1;
+    }
+    if (!changed)
+        return;
+
+#if LED_BANK_WRITE
+    // if any of the LEDs on pins 0-7 changed, write them all at once
+    for (i = 0; i < LED_COUNT; i++) {
+        if (led_pins[i] < 8 && (changed & (1u << i))) {
+            bank = 1;
+        }
+    }
+    if (bank) {
+        int value = 0;
+        for (i = 0; i < LED_COUNT; i++) {
+            if (led_pins[i] < 8 && (states->bits & (1u << i))) {
+                value |= 1 << led_pins[i];
+            }
+        }
+        digitalWriteByte( value );
+    }
+#endif
 
-    digitalWrite( LED_ONLINE,              states->online );
-    digitalWrite( LED_WEBSOCKET_CONNECTED, states->websocket_connected );
-    digitalWrite( LED_X_AXIS_ACTIVE,       states->x_axis_active );
-    digitalWrite( LED_Y_AXIS_ACTIVE,       states->y_axis_active );
-    digitalWrite( LED_Z_AXIS_ACTIVE,       states->z_axis_active );
-    digitalWrite( LED_A_AXIS_ACTIVE,       states->a_axis_active );
-    digitalWrite( LED_MOTION_SPEED_1,      states->motion_speed_1 );
-    digitalWrite( LED_MOTION_SPEED_2,      states->motion_speed_2 );
-    digitalWrite( LED_MOTION_SPEED_3,      states->motion_speed_3 );
-    digitalWrite( LED_MOTION_SPEED_4,      states->motion_speed_4 );
+    for (i = 0; i < LED_COUNT; i++) {
+        if (!(changed & (1u << i)))
+            continue;
+#if LED_BANK_WRITE
+        if (led_pins[i] < 8)
+            continue;
+#endif
+        digitalWrite( led_pins[i], (states->bits >> i) & 1 );
+    }
+    states->written       = states->bits;
+    states->written_valid = 1;
     return;
 }
 
 #endif
-
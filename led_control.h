@@ -4,17 +4,26 @@
 
 #include "shuttle.h"
 
+// One bit per LED, in the order of led_pins[] in led_control.c
+typedef enum {
+    LED_BIT_ONLINE              = 1 << 0,
+    LED_BIT_WEBSOCKET_CONNECTED = 1 << 1,
+    LED_BIT_X_AXIS_ACTIVE       = 1 << 2,
+    LED_BIT_Y_AXIS_ACTIVE       = 1 << 3,
+    LED_BIT_Z_AXIS_ACTIVE       = 1 << 4,
+    LED_BIT_A_AXIS_ACTIVE       = 1 << 5,
+    LED_BIT_MOTION_SPEED_1      = 1 << 6,
+    LED_BIT_MOTION_SPEED_2      = 1 << 7,
+    LED_BIT_MOTION_SPEED_3      = 1 << 8,
+    LED_BIT_MOTION_SPEED_4      = 1 << 9,
+} LED_BIT;
+
+#define LED_COUNT                10
+
 typedef struct {
-    short int online;
-    short int websocket_connected;
-    short int x_axis_active;
-    short int y_axis_active;
-    short int z_axis_active;
-    short int a_axis_active;
-    short int motion_speed_1;
-    short int motion_speed_2;
-    short int motion_speed_3;
-    short int motion_speed_4;
+    unsigned int bits;           // what the LEDs should show
+    unsigned int written;        // what was last written to the pins
+    short int    written_valid;  // 0 until the pins have been written once
 } LED_STATES;
 
 
@@ -29,6 +38,14 @@ typedef struct {
 #define LED_MOTION_SPEED_3       16
 #define LED_MOTION_SPEED_4       15
 
+// Set to 1 to write the LEDs on wiringPi pins 0-7 with one
+// digitalWriteByte(), which on the Pi is a single set and a single
+// clear of the GPIO registers.  That also drives the other pins in
+// 0-7 low, so only use it when none of them is an output for
+// something else (pin 5 is the reconnect switch, an input, which
+// isn't affected).
+#define LED_BANK_WRITE           0
+
 
 
 void initialize_led_states( LED_STATES *states );
@@ -0,0 +1,145 @@
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+int log_level = LOG_LEVEL_INFO;
+
+// A bounded multi-producer ring: the main thread, the input thread and
+// the switch interrupt threads can all log.  Each slot's sequence
+// number says whether it is free for the producer at that position or
+// holds a message for the consumer, so producers only contend on the
+// tail index.  Only one thread at a time flushes.
+typedef struct {
+    atomic_uint seq;
+    int         level;
+    char        text[LOG_LINE_MAX];
+} LOG_SLOT;
+
+static LOG_SLOT     ring[LOG_RING_SIZE];
+static atomic_uint  ring_tail;              // next position to claim
+static unsigned int ring_head;              // next position to print, flusher only
+static atomic_flag  flushing = ATOMIC_FLAG_INIT;
+static atomic_uint  dropped;                // messages lost to a full ring or the rate limit
+static atomic_long  window_start;           // second the rate limit is counting
+static atomic_uint  window_count;           // messages logged in that second
+
+static const char *level_names[] = { "error", "warn", "info", "debug", "trace" };
+
+
+// Level from a name or a number, -1 if it is neither
+int log_parse_level( const char *name ) {
+    int i;
+
+    for (i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_TRACE; i++) {
+        if (strcasecmp( name, level_names[i] ) == 0)
+            return i;
+    }
+    if (name[0] >= '0' && name[0] <= '4' && name[1] == '\0')
+        return name[0] - '0';
+    return -1;
+}
+
+
+// Set up the ring, and take the level from SHUTTLECP_LOG if it is set
+void log_init( void ) {
+    const char *env = getenv( "SHUTTLECP_LOG" );
+    int i, level;
+
+    for (i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_init( &ring[i].seq, i );
+    }
+    if (env) {
+        level = log_parse_level( env );
+        if (level < 0) {
+            fprintf(stderr, "SHUTTLECP_LOG: unknown level %s\n", env);
+        } else {
+            log_level = level;
+        }
+    }
+    atexit( log_flush );
+}
+
+
+void log_write( int level, const char *fmt, ... ) {
+    LOG_SLOT *slot;
+    unsigned int pos, seq;
+    long now;
+    va_list args;
+
+    // keep a flood of messages from swamping the log, errors excepted
+    if (level > LOG_LEVEL_ERROR) {
+        now = time( NULL );
+        if (atomic_load_explicit( &window_start, memory_order_relaxed ) != now) {
+            atomic_store_explicit( &window_start, now, memory_order_relaxed );
+            atomic_store_explicit( &window_count, 0, memory_order_relaxed );
+        }
+        if (atomic_fetch_add_explicit( &window_count, 1, memory_order_relaxed ) >= LOG_MAX_PER_SECOND) {
+            atomic_fetch_add_explicit( &dropped, 1, memory_order_relaxed );
+            return;
+        }
+    }
+
+    pos = atomic_load_explicit( &ring_tail, memory_order_relaxed );
+    while (1) {
+        slot = &ring[pos & (LOG_RING_SIZE - 1)];
+        seq  = atomic_load_explicit( &slot->seq, memory_order_acquire );
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit( &ring_tail, &pos, pos + 1,
+                                                       memory_order_relaxed, memory_order_relaxed ))
+                break;
+        } else if ((int)(seq - pos) < 0) {
+            atomic_fetch_add_explicit( &dropped, 1, memory_order_relaxed );
+            return;                             // full
+        } else {
+            pos = atomic_load_explicit( &ring_tail, memory_order_relaxed );
+        }
+    }
+
+    slot->level = level;
+    va_start( args, fmt );
+    vsnprintf( slot->text, sizeof(slot->text), fmt, args );
+    va_end( args );
+    atomic_store_explicit( &slot->seq, pos + 1, memory_order_release );
+}
+
+
+// Write out everything logged so far, in as few writes as possible
+void log_flush( void ) {
+    char buf[4096];
+    int len = 0;
+    LOG_SLOT *slot;
+    unsigned int lost;
+
+    if (atomic_flag_test_and_set_explicit( &flushing, memory_order_acquire ))
+        return;                                 // someone else is at it
+
+    while (1) {
+        slot = &ring[ring_head & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit( &slot->seq, memory_order_acquire ) != ring_head + 1)
+            break;
+        if (len + LOG_LINE_MAX + 16 > (int)sizeof(buf)) {
+            if (write( STDERR_FILENO, buf, len ) < 0) {
+                // nowhere left to complain to
+            }
+            len = 0;
+        }
+        len += snprintf( buf + len, sizeof(buf) - len, "%s%s\n",
+                         slot->level == LOG_LEVEL_ERROR ? "ERROR: " :
+                         slot->level == LOG_LEVEL_WARN  ? "WARNING: " : "", slot->text );
+        atomic_store_explicit( &slot->seq, ring_head + LOG_RING_SIZE, memory_order_release );
+        ring_head++;
+    }
+
+    lost = atomic_exchange_explicit( &dropped, 0, memory_order_relaxed );
+    if (lost) {
+        len += snprintf( buf + len, sizeof(buf) - len, "(%u log messages dropped)\n", lost );
+    }
+    if (len > 0 && write( STDERR_FILENO, buf, len ) < 0) {
+        // nowhere left to complain to
+    }
+    atomic_flag_clear_explicit( &flushing, memory_order_release );
+}
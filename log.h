@@ -0,0 +1,43 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+// Messages are formatted into a lock-free ring and written out by
+// log_flush() once the main loop has finished its work, so logging
+// never waits on stderr (journald under systemd).  Anything below the
+// current level isn't even formatted.
+#define LOG_RING_SIZE       256     // messages, must be a power of two
+#define LOG_LINE_MAX        200     // longer messages are truncated
+#define LOG_MAX_PER_SECOND  200     // messages above ERROR beyond this are dropped
+
+typedef enum {
+    LOG_LEVEL_ERROR = 0,    // something failed
+    LOG_LEVEL_WARN  = 1,    // something odd, but we carry on
+    LOG_LEVEL_INFO  = 2,    // connections, switch presses (the default)
+    LOG_LEVEL_DEBUG = 3,    // one line per event and per transport write
+    LOG_LEVEL_TRACE = 4,    // every frame as it goes out
+} LOG_LEVEL;
+
+extern int log_level;
+
+#define LOG_AT( level, ... ) \
+    do { if ((level) <= log_level) log_write( (level), __VA_ARGS__ ); } while (0)
+
+#define LOG_ERROR( ... )  LOG_AT( LOG_LEVEL_ERROR, __VA_ARGS__ )
+#define LOG_WARN( ... )   LOG_AT( LOG_LEVEL_WARN,  __VA_ARGS__ )
+#define LOG_INFO( ... )   LOG_AT( LOG_LEVEL_INFO,  __VA_ARGS__ )
+#define LOG_DEBUG( ... )  LOG_AT( LOG_LEVEL_DEBUG, __VA_ARGS__ )
+#define LOG_TRACE( ... )  LOG_AT( LOG_LEVEL_TRACE, __VA_ARGS__ )
+
+// the equivalent of perror()
+#define LOG_ERRNO( what ) LOG_ERROR( "%s: %s", (what), strerror( errno ) )
+
+void log_init( void );
+int  log_parse_level( const char *name );
+void log_write( int level, const char *fmt, ... ) __attribute__(( format( printf, 2, 3 ) ));
+void log_flush( void );
+
+#endif   /* LOG_H - do not put anything below this line! */
@@ -0,0 +1,103 @@
+#include "metrics.h"
+#include "stats.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+static EVENT_LOOP *metrics_loop = NULL;
+static int        num_clients = 0;
+
+
+static void metrics_close( int fd ) {
+    event_loop_remove( metrics_loop, fd );
+    close( fd );
+    num_clients--;
+}
+
+
+// Event loop handler for a scraper.  The request line is all we need
+// to see, and it arrives in the first read; the reply is small enough
+// for the socket buffer to take it in one go.
+static void metrics_client_event( int fd, unsigned int events, void *data ) {
+    static char response[METRICS_MAX_RESPONSE];
+    static const char header[] =
+        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n"
+        "Content-Length: %d\r\n\r\n";
+    char request[512], body[METRICS_MAX_RESPONSE - 128];
+    int n, body_len, len;
+
+    (void)events;
+    (void)data;
+    n = read( fd, request, sizeof(request) );
+    if (n < 0 && errno == EAGAIN)
+        return;
+    if (n > 0) {
+        body_len = stats_prometheus( body, sizeof(body) );
+        if (body_len < 0) {
+            LOG_ERROR( "Metrics don't fit in %d bytes", (int)sizeof(body) );
+            body_len = 0;
+        }
+        len = snprintf( response, sizeof(response), header, body_len );
+        memcpy( response + len, body, body_len );
+        if (send( fd, response, len + body_len, MSG_NOSIGNAL | MSG_DONTWAIT ) != len + body_len) {
+            LOG_WARN( "Could not send the metrics" );
+        }
+    }
+    metrics_close( fd );
+}
+
+
+// Event loop handler for the listening socket
+static void metrics_accept_event( int fd, unsigned int events, void *data ) {
+    int client;
+
+    (void)events;
+    (void)data;
+    while ((client = accept( fd, NULL, NULL )) >= 0) {
+        fcntl( client, F_SETFL, O_NONBLOCK );
+        fcntl( client, F_SETFD, FD_CLOEXEC );
+        if (num_clients == METRICS_MAX_CLIENTS ||
+            event_loop_add( metrics_loop, client, EPOLLIN, metrics_client_event, NULL )) {
+            close( client );
+            continue;
+        }
+        num_clients++;
+    }
+}
+
+
+// Listen for scrapes on port, on every interface.  Returns 0, or 1 if
+// the port can't be had.
+int metrics_init( EVENT_LOOP *loop, const char *port ) {
+    struct addrinfo hints, *ai;
+    int fd, one = 1;
+
+    metrics_loop = loop;
+    memset( &hints, 0, sizeof(hints) );
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+    if (getaddrinfo( NULL, port, &hints, &ai ) != 0) {
+        LOG_ERROR( "Bad metrics port: %s", port );
+        return 1;
+    }
+    fd = socket( ai->ai_family, ai->ai_socktype, 0 );
+    if (fd >= 0) {
+        setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+        fcntl( fd, F_SETFL, O_NONBLOCK );
+        fcntl( fd, F_SETFD, FD_CLOEXEC );
+    }
+    if (fd < 0 || bind( fd, ai->ai_addr, ai->ai_addrlen ) < 0 || listen( fd, METRICS_MAX_CLIENTS ) < 0) {
+        LOG_ERRNO( "metrics port" );
+        freeaddrinfo( ai );
+        return 1;
+    }
+    freeaddrinfo( ai );
+    LOG_INFO( "Serving metrics on port %s", port );
+    return event_loop_add( loop, fd, EPOLLIN, metrics_accept_event, NULL );
+}
@@ -0,0 +1,15 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "event_loop.h"
+
+// A minimal HTTP endpoint for Prometheus to scrape: whatever is asked
+// for, the answer is stats_prometheus(), and the connection is closed.
+// It runs in the main event loop, so a scrape costs one pass and never
+// competes with the jog controller for a thread.
+#define METRICS_MAX_CLIENTS  4        // scrapes in progress at once
+#define METRICS_MAX_RESPONSE 8192     // the whole reply, headers included
+
+int metrics_init( EVENT_LOOP *loop, const char *port );
+
+#endif   /* METRICS_H - do not put anything below this line! */
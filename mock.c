@@ -0,0 +1,174 @@
+#include "mock.h"
+#include "log.h"
+#include <nopoll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+static pid_t mock_pid = -1;
+
+
+// Reply "ok" to each line of a "send", "sendjson" or "sendnobuf" frame
+// for the serial port it names, as SPJS would pass on from GRBL, along
+// with SPJS's own Queued/Write reports of how many lines it holds.
+// Real-time characters don't get an "ok" from GRBL, so neither do
+// sendnobuf frames.
+static void mock_spjs_msg( noPollCtx *ctx, noPollConn *conn, noPollMsg *msg, noPollPtr user_data ) {
+    const char *frame = (const char *)nopoll_msg_get_payload( msg );
+    int len = nopoll_msg_get_payload_size( msg );
+    char text[2048], device[128], reply[256];
+    const char *p;
+    int i, lines = 0, n;
+
+    (void)ctx;
+    (void)user_data;
+    if (len >= (int)sizeof(text))
+        len = sizeof(text) - 1;
+    memcpy( text, frame, len );
+    text[len] = '\0';
+
+    device[0] = '\0';
+    if (strncmp( text, "send ", 5 ) == 0) {
+        sscanf( text + 5, "%127s", device );
+        for (p = text + 5; *p; p++) {
+            if (*p == '\n') lines++;
+        }
+    } else if (strncmp( text, "sendjson ", 9 ) == 0) {
+        p = strstr( text, "\"P\":\"" );
+        if (p)
+            sscanf( p + 5, "%127[^\"]", device );
+        for (p = text; (p = strstr( p, "\\n" )) != NULL; p += 2) {
+            lines++;
+        }
+    }
+
+    if (lines == 0)
+        return;
+    n = snprintf( reply, sizeof(reply), "{\"Cmd\":\"Queued\",\"QCnt\":%d,\"Port\":\"%s\"}", lines, device );
+    nopoll_conn_send_text( conn, reply, n );
+    for (i = 0; i < lines; i++) {
+        n = snprintf( reply, sizeof(reply), "{\"Cmd\":\"Write\",\"QCnt\":%d,\"P\":\"%s\"}", lines - i - 1, device );
+        nopoll_conn_send_text( conn, reply, n );
+        n = snprintf( reply, sizeof(reply), "{\"P\":\"%s\",\"D\":\"ok\\n\"}", device );
+        nopoll_conn_send_text( conn, reply, n );
+    }
+}
+
+static void mock_spjs( const char *port, int ready_fd ) {
+    noPollCtx *ctx = nopoll_ctx_new();
+    noPollConn *listener;
+
+    listener = ctx ? nopoll_listener_new( ctx, "0.0.0.0", port ) : NULL;
+    if (!nopoll_conn_is_ok( listener )) {
+        fprintf(stderr, "mock SPJS: could not listen on port %s\n", port);
+        _exit(1);
+    }
+    nopoll_ctx_set_on_msg( ctx, mock_spjs_msg, NULL );
+    if (write( ready_fd, "", 1 ) != 1) {
+        _exit(1);
+    }
+    close( ready_fd );
+    nopoll_loop_wait( ctx, 0 );
+    _exit(0);
+}
+
+
+// A keep-alive HTTP server that is good for one client at a time,
+// which is all curl ever needs from us.
+static void mock_bcnc( const char *port, int ready_fd ) {
+    static const char response[] =
+        "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nContent-Type: text/plain\r\n\r\nOK";
+    struct addrinfo hints, *ai;
+    char buf[4096];
+    int listen_fd, fd, len = 0, n, one = 1;
+    char *end;
+
+    memset( &hints, 0, sizeof(hints) );
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+    if (getaddrinfo( NULL, port, &hints, &ai ) != 0) {
+        _exit(1);
+    }
+    listen_fd = socket( ai->ai_family, ai->ai_socktype, 0 );
+    if (listen_fd >= 0)
+        setsockopt( listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+    if (listen_fd < 0 || bind( listen_fd, ai->ai_addr, ai->ai_addrlen ) < 0 || listen( listen_fd, 4 ) < 0) {
+        fprintf(stderr, "mock bCNC: could not listen on port %s\n", port);
+        _exit(1);
+    }
+    if (write( ready_fd, "", 1 ) != 1) {
+        _exit(1);
+    }
+    close( ready_fd );
+
+    while ((fd = accept( listen_fd, NULL, NULL )) >= 0) {
+        len = 0;
+        while ((n = read( fd, buf + len, sizeof(buf) - 1 - len )) > 0) {
+            len += n;
+            buf[len] = '\0';
+            // answer every complete request in the buffer
+            while ((end = strstr( buf, "\r\n\r\n" )) != NULL) {
+                if (write( fd, response, sizeof(response) - 1 ) < 0)
+                    break;
+                len -= end + 4 - buf;
+                memmove( buf, end + 4, len + 1 );
+            }
+            if (len == sizeof(buf) - 1)
+                len = 0;                // junk, throw it away
+        }
+        close( fd );
+    }
+    _exit(0);
+}
+
+
+// Start the mock in a child process and wait until it is listening
+int mock_start( const char *port, int bcnc ) {
+    int ready[2];
+    char c;
+
+    if (pipe( ready ) < 0) {
+        LOG_ERRNO( "pipe" );
+        return 1;
+    }
+    mock_pid = fork();
+    if (mock_pid < 0) {
+        LOG_ERRNO( "fork" );
+        return 1;
+    }
+    if (mock_pid == 0) {
+        close( ready[0] );
+        signal( SIGPIPE, SIG_IGN );
+        if (bcnc) {
+            mock_bcnc( port, ready[1] );
+        } else {
+            mock_spjs( port, ready[1] );
+        }
+    }
+
+    close( ready[1] );
+    if (read( ready[0], &c, 1 ) != 1) {
+        LOG_ERROR( "Mock %s didn't start", bcnc ? "bCNC" : "SPJS" );
+        close( ready[0] );
+        return 1;
+    }
+    close( ready[0] );
+    LOG_INFO( "Mock %s listening on port %s", bcnc ? "bCNC" : "SPJS", port );
+    atexit( mock_stop );
+    return 0;
+}
+
+void mock_stop( void ) {
+    if (mock_pid > 0) {
+        kill( mock_pid, SIGTERM );
+        waitpid( mock_pid, NULL, 0 );
+        mock_pid = -1;
+    }
+}
@@ -0,0 +1,14 @@
+#ifndef MOCK_H
+#define MOCK_H
+
+// A stand-in for SPJS or bCNC, run in a child process so benchmarks
+// and replays don't need the real thing.  The SPJS mock answers every
+// line it is sent with "ok", the way SPJS relays GRBL's replies; the
+// bCNC mock answers every request with 200 OK.
+#define MOCK_HOST  "localhost"
+#define MOCK_PORT  "18989"
+
+int  mock_start( const char *port, int bcnc );
+void mock_stop( void );
+
+#endif   /* MOCK_H - do not put anything below this line! */
@@ -0,0 +1,222 @@
+#include "planner.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+static long elapsed_us( const struct timespec *from, const struct timespec *to ) {
+    return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+// Find token inside the first len bytes of str, NULL if not there
+static const char *find_token( const char *str, int len, const char *token ) {
+    int tlen = strlen( token );
+    int i;
+
+    for (i = 0; i + tlen <= len; i++) {
+        if (memcmp( str + i, token, tlen ) == 0)
+            return str + i;
+    }
+    return NULL;
+}
+
+
+// forget everything, e.g. after a reconnect
+void planner_init( PLANNER_STATE *p ) {
+    memset( p, 0, sizeof(*p) );
+    p->blocks_free = -1;
+}
+
+
+// Record that lines of G-code were handed to SPJS, each of which will
+// be answered with an "ok" (or "error") once the controller takes it.
+void planner_lines_sent( PLANNER_STATE *p, int lines ) {
+    struct timespec now;
+    int slot;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    while (lines-- > 0) {
+        if (p->pending_lines < PLANNER_MAX_PENDING) {
+            slot = (p->sent_head + p->pending_lines) % PLANNER_MAX_PENDING;
+            p->sent_at[slot] = now;
+        }
+        p->pending_lines++;
+    }
+    if (p->pending_lines == 1) {
+        p->last_ack = now;  // start the stale timer from the first send
+    }
+}
+
+
+// Account for duration_us worth of motion appended to the planner.
+// The motion runs back to back, so it starts when the previous lot
+// finishes, or now if the machine has already caught up.
+void planner_motion_queued( PLANNER_STATE *p, long duration_us ) {
+    struct timespec now;
+    long ns;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    if (elapsed_us( &now, &p->motion_end ) < 0) {
+        p->motion_end = now;
+    }
+    ns = p->motion_end.tv_nsec + (duration_us % 1000000) * 1000;
+    p->motion_end.tv_sec  += duration_us / 1000000 + ns / 1000000000;
+    p->motion_end.tv_nsec  = ns % 1000000000;
+}
+
+
+// The controller threw away the motion it had queued (a jog cancel)
+void planner_motion_cancelled( PLANNER_STATE *p ) {
+    clock_gettime( CLOCK_MONOTONIC, &p->motion_end );
+}
+
+
+// how much queued shuttle motion is left before the machine runs dry
+long planner_lookahead_us( PLANNER_STATE *p ) {
+    struct timespec now;
+    long remaining;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    remaining = elapsed_us( &now, &p->motion_end );
+    return (remaining > 0) ? remaining : 0;
+}
+
+
+// How much motion we want queued ahead.  It has to cover at least one
+// round trip to the controller, or the planner runs dry before the
+// next segment arrives, but every extra bit is coast after release.
+long planner_lookahead_target( PLANNER_STATE *p, long min_us, long max_us ) {
+    long target = 2 * p->ack_latency_us;
+
+    if (target < min_us) target = min_us;
+    if (target > max_us) target = max_us;
+    return target;
+}
+
+
+// If acknowledgements stop arriving (another client swallowed them, or
+// the controller was reset) stop waiting for them rather than stalling.
+void planner_check_stale( PLANNER_STATE *p, long timeout_us ) {
+    struct timespec now;
+
+    if (p->pending_lines == 0)
+        return;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    if (elapsed_us( &p->last_ack, &now ) > timeout_us) {
+        p->pending_lines = 0;
+        p->sent_head     = 0;
+        p->blocks_free   = -1;
+    }
+}
+
+
+// one line of controller output has been acknowledged
+static void planner_ack( PLANNER_STATE *p ) {
+    struct timespec now;
+    long latency;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    p->last_ack = now;
+    if (p->pending_lines == 0)
+        return;     // the "ok" was for someone else's command
+
+    if (p->pending_lines <= PLANNER_MAX_PENDING) {
+        latency = elapsed_us( &p->sent_at[p->sent_head], &now );
+        if (p->ack_latency_us == 0) {
+            p->ack_latency_us = latency;
+        } else {
+            p->ack_latency_us += (latency - p->ack_latency_us) / 8;
+        }
+    }
+    p->sent_head = (p->sent_head + 1) % PLANNER_MAX_PENDING;
+    p->pending_lines--;
+}
+
+
+// Look at one line of controller output.  escaped is set when it is
+// still JSON escaped, as it is inside an SPJS message.
+void planner_parse_line( PLANNER_STATE *p, const char *line, int len, int escaped ) {
+    const char *field;
+
+    if (len <= 0)
+        return;
+
+    // GRBL: "ok" / "error:N" for each line received
+    if ((len >= 2 && memcmp( line, "ok", 2 ) == 0) ||
+        (len >= 5 && memcmp( line, "error", 5 ) == 0)) {
+        planner_ack( p );
+        return;
+    }
+
+    // GRBL 1.1 status report, e.g. <Run|MPos:...|Bf:12,120|...>
+    if (line[0] == '<') {
+        field = find_token( line, len, "Bf:" );
+        if (field) {
+            p->blocks_free = atoi( field + 3 );
+        }
+        return;
+    }
+
+    // TinyG / g2core JSON: {"r":{...}} acknowledges a line and
+    // {"qr":N} reports the number of free planner buffers.
+    if (line[0] == '{') {
+        if (find_token( line, len, escaped ? "{\\\"r\\\":" : "{\"r\":" ) == line) {
+            planner_ack( p );
+        }
+        field = find_token( line, len, escaped ? "qr\\\":" : "qr\":" );
+        if (field) {
+            p->blocks_free = atoi( field + (escaped ? 5 : 4) );
+        }
+    }
+}
+
+
+// Parse one SPJS message.  Data from the serial port arrives as
+// {"P":"/dev/ttyACM0","D":"ok\n"}, where D can carry several lines.
+// SPJS's own {"Cmd":"Queued"/"Write"/"Complete",...} replies carry
+// "QCnt", the number of lines it still has to feed the controller.
+// Anything else SPJS sends is ignored here.
+void planner_parse_reply( PLANNER_STATE *p, const char *msg, int len ) {
+    const char *d, *line, *end = msg + len;
+
+    d = find_token( msg, len, "\"QCnt\":" );
+    if (d) {
+        p->spjs_queued = atoi( d + 7 );
+        clock_gettime( CLOCK_MONOTONIC, &p->spjs_report );
+        return;
+    }
+
+    d = find_token( msg, len, "\"D\":\"" );
+    if (d == NULL)
+        return;
+    d += 5;
+
+    line = d;
+    while (d < end && *d != '"') {
+        if (*d == '\\' && d + 1 < end) {
+            if (d[1] == 'n' || d[1] == 'r') {
+                planner_parse_line( p, line, d - line, 1 );
+                line = d + 2;
+            }
+            d += 2;     // also skips escaped quotes
+            continue;
+        }
+        d++;
+    }
+    planner_parse_line( p, line, d - line, 1 );
+}
+
+
+// How many lines SPJS has queued up for the port, as of its last
+// report.  A report older than timeout_us is not trusted any more, so
+// a lost reply can't hold us back for good.
+int planner_spjs_queued( PLANNER_STATE *p, long timeout_us ) {
+    struct timespec now;
+
+    if (p->spjs_queued == 0)
+        return 0;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    if (elapsed_us( &p->spjs_report, &now ) > timeout_us) {
+        p->spjs_queued = 0;
+    }
+    return p->spjs_queued;
+}
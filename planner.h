@@ -0,0 +1,35 @@
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include <time.h>
+
+// Number of unacknowledged lines we remember send times for
+#define PLANNER_MAX_PENDING 64
+
+// What we know about how much work is queued up ahead of the machine,
+// built from the commands we send and the replies the controller
+// echoes back through SPJS.
+typedef struct {
+    int             pending_lines;      // device lines sent, waiting for "ok"
+    struct timespec sent_at[PLANNER_MAX_PENDING]; // send time of each pending line
+    int             sent_head;          // index of the oldest pending line
+    int             blocks_free;        // last GRBL Bf: / TinyG qr report, -1 if unknown
+    long            ack_latency_us;     // smoothed send to "ok" time, 0 until measured
+    struct timespec last_ack;           // when we last saw an acknowledgement
+    struct timespec motion_end;         // estimated time queued shuttle motion runs out
+    int             spjs_queued;        // lines SPJS last said it holds for the port ("QCnt")
+    struct timespec spjs_report;        // when it said so
+} PLANNER_STATE;
+
+void planner_init( PLANNER_STATE *p );
+void planner_lines_sent( PLANNER_STATE *p, int lines );
+void planner_motion_queued( PLANNER_STATE *p, long duration_us );
+void planner_motion_cancelled( PLANNER_STATE *p );
+long planner_lookahead_us( PLANNER_STATE *p );
+long planner_lookahead_target( PLANNER_STATE *p, long min_us, long max_us );
+void planner_check_stale( PLANNER_STATE *p, long timeout_us );
+void planner_parse_line( PLANNER_STATE *p, const char *line, int len, int escaped );
+void planner_parse_reply( PLANNER_STATE *p, const char *msg, int len );
+int  planner_spjs_queued( PLANNER_STATE *p, long timeout_us );
+
+#endif   /* PLANNER_H - do not put anything below this line! */
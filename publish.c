@@ -0,0 +1,177 @@
+#include "publish.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static EVENT_LOOP    *publish_loop = NULL;
+static int           listen_fd = -1;
+static int           clients[PUBLISH_MAX_CLIENTS];
+static int           num_clients = 0;
+static PUBLISH_STATE published;             // what the clients were last sent
+static short int     have_published = 0;
+
+
+static void publish_drop( int i ) {
+    LOG_DEBUG( "Publish client %d went away", clients[i] );
+    event_loop_remove( publish_loop, clients[i] );
+    close( clients[i] );
+    clients[i] = clients[--num_clients];
+}
+
+
+// A client that can't take a whole message at once has stopped
+// reading; rather lose it than hold anything up for it.
+static int publish_write( int fd, const char *msg, int len ) {
+    return send( fd, msg, len, MSG_NOSIGNAL | MSG_DONTWAIT ) == len ? 0 : -1;
+}
+
+
+// One device's fields that differ from was, or all of them if was is
+// NULL, as a JSON object.  Returns its length, 0 if nothing differs.
+static int publish_device( char *msg, int index, const PUBLISH_DEVICE *dev, const PUBLISH_DEVICE *was ) {
+    int len, changed = 0;
+
+    len = snprintf( msg, PUBLISH_MAX_LINE, "{\"device\":%d", index );
+    if (!was || dev->connected != was->connected) {
+        len += snprintf( msg + len, PUBLISH_MAX_LINE - len, ",\"connected\":%d", dev->connected );
+        changed = 1;
+    }
+    if (!was || dev->axis != was->axis) {
+        len += snprintf( msg + len, PUBLISH_MAX_LINE - len, ",\"axis\":\"%c\"", dev->axis );
+        changed = 1;
+    }
+    if (!was || dev->speed != was->speed || dev->increment != was->increment) {
+        len += snprintf( msg + len, PUBLISH_MAX_LINE - len, ",\"speed\":%d,\"increment\":%g",
+                         dev->speed, dev->increment );
+        changed = 1;
+    }
+    if (!changed)
+        return 0;
+    return len + snprintf( msg + len, PUBLISH_MAX_LINE - len, "}\n" );
+}
+
+
+// The connection flag and the number of devices, as a JSON object
+static int publish_summary( char *msg, const PUBLISH_STATE *state ) {
+    return snprintf( msg, PUBLISH_MAX_LINE, "{\"cnc_connected\":%d,\"devices\":%d}\n",
+                     state->cnc_connected, state->num_devices );
+}
+
+
+// Event loop handler for a subscriber.  They have nothing to say; this
+// only notices them hanging up.
+static void publish_client_event( int fd, unsigned int events, void *data ) {
+    char buf[64];
+    int i, n;
+
+    (void)data;
+    n = read( fd, buf, sizeof(buf) );
+    if (n > 0 && !(events & (EPOLLERR | EPOLLHUP)))
+        return;
+    if (n < 0 && errno == EAGAIN)
+        return;
+    for (i = 0; i < num_clients; i++) {
+        if (clients[i] == fd) {
+            publish_drop( i );
+            return;
+        }
+    }
+}
+
+
+// Event loop handler for the listening socket: take the new subscriber
+// and bring it up to date
+static void publish_accept_event( int fd, unsigned int events, void *data ) {
+    char msg[PUBLISH_MAX_LINE];
+    int client, i, len;
+
+    (void)events;
+    (void)data;
+    while ((client = accept( fd, NULL, NULL )) >= 0) {
+        fcntl( client, F_SETFL, O_NONBLOCK );
+        fcntl( client, F_SETFD, FD_CLOEXEC );
+        if (num_clients == PUBLISH_MAX_CLIENTS ||
+            event_loop_add( publish_loop, client, EPOLLIN, publish_client_event, NULL )) {
+            LOG_WARN( "Too many publish clients, turning one away" );
+            close( client );
+            continue;
+        }
+        clients[num_clients++] = client;
+        LOG_DEBUG( "Publish client %d connected", client );
+        if (!have_published)
+            continue;
+        len = publish_summary( msg, &published );
+        if (publish_write( client, msg, len )) {
+            publish_drop( num_clients - 1 );
+            continue;
+        }
+        for (i = 0; i < published.num_devices; i++) {
+            len = publish_device( msg, i, &published.devices[i], NULL );
+            if (publish_write( client, msg, len )) {
+                publish_drop( num_clients - 1 );
+                break;
+            }
+        }
+    }
+}
+
+
+// Start listening on path, replacing a socket left over from an
+// earlier run.  Returns 0, or 1 if it can't.
+int publish_init( EVENT_LOOP *loop, const char *path ) {
+    struct sockaddr_un addr;
+
+    publish_loop = loop;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    if (strlen( path ) >= sizeof(addr.sun_path)) {
+        LOG_ERROR( "Publish socket path too long: %s", path );
+        return 1;
+    }
+    strcpy( addr.sun_path, path );
+    unlink( path );
+
+    listen_fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if (listen_fd < 0 ||
+        bind( listen_fd, (struct sockaddr *)&addr, sizeof(addr) ) < 0 ||
+        listen( listen_fd, PUBLISH_MAX_CLIENTS ) < 0) {
+        LOG_ERRNO( path );
+        return 1;
+    }
+    LOG_INFO( "Publishing pendant state on %s", path );
+    return event_loop_add( loop, listen_fd, EPOLLIN, publish_accept_event, NULL );
+}
+
+
+// Tell every subscriber what changed since the last call.  Cheap when
+// nothing did, so it can be called after every event.
+void publish_state( const PUBLISH_STATE *state ) {
+    char msg[PUBLISH_MAX_LINE * (PUBLISH_MAX_DEVICES + 1)];
+    int i, len = 0;
+
+    if (listen_fd < 0)
+        return;
+    if (have_published) {
+        if (state->cnc_connected != published.cnc_connected || state->num_devices != published.num_devices) {
+            len = publish_summary( msg, state );
+        }
+        for (i = 0; i < state->num_devices; i++) {
+            len += publish_device( msg + len, i, &state->devices[i],
+                                   i < published.num_devices ? &published.devices[i] : NULL );
+        }
+    }
+    published = *state;
+    have_published = 1;
+    if (len == 0)
+        return;
+    for (i = num_clients - 1; i >= 0; i--) {
+        if (publish_write( clients[i], msg, len )) {
+            publish_drop( i );
+        }
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef PUBLISH_H
+#define PUBLISH_H
+
+#include "event_loop.h"
+
+// Pendant state for local subscribers (browser UIs, dashboards): a
+// Unix domain stream socket any number of clients can connect to.  Each
+// gets one JSON object per line, the whole state when it connects and
+// after that only what changed, as soon as it changes.  Nothing is
+// read from the clients and nobody has to poll.
+#define PUBLISH_MAX_CLIENTS  8    // subscribers at once, the rest are turned away
+#define PUBLISH_MAX_DEVICES  4    // jog controllers described
+#define PUBLISH_MAX_LINE     256  // longest message
+
+// The same things the LEDs show, for every jog controller
+typedef struct {
+    short int connected;          // the jog controller is open
+    char      axis;               // 'X', 'Y', ...
+    int       speed;              // increment button position, 1 to NUM_MOTION_SPEEDS
+    double    increment;          // distance of one jog click at that speed
+} PUBLISH_DEVICE;
+
+typedef struct {
+    short int      cnc_connected; // SPJS, bCNC or the controller is reachable
+    int            num_devices;
+    PUBLISH_DEVICE devices[PUBLISH_MAX_DEVICES];
+} PUBLISH_STATE;
+
+int  publish_init( EVENT_LOOP *loop, const char *path );
+void publish_state( const PUBLISH_STATE *state );
+
+#endif   /* PUBLISH_H - do not put anything below this line! */
@@ -1,7 +1,27 @@
 
 #if GPIO_SUPPORT
 #include "raspi_switches.h"
+#include "log.h"
 #include <wiringPi.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+// The switches are interrupt driven.  wiringPi calls the ISRs below on
+// a thread of its own for each pin; they count presses and wake the
+// event loop through switch_fd, and read_raspi_switches() then turns
+// the counts into the same press/release state the polling loop used
+// to see.  Counting means a press shorter than one pass of the loop
+// is still reported.
+enum { SW_FEED_HOLD, SW_RESUME, SW_RESET, SW_RECONNECT, SW_COUNT };
+
+static const int    switch_pins[SW_COUNT] = { SWITCH_FEED_HOLD, SWITCH_RESUME, SWITCH_RESET, SWITCH_RECONNECT };
+static atomic_uint  presses[SW_COUNT];      // written by the ISRs
+static unsigned int presses_seen[SW_COUNT]; // what read_raspi_switches() has reported
+static struct timespec pressed_at[SW_COUNT];   // when the latest press's first edge was seen, by its ISR
+static int          switch_fd = -1;
 
 
 // initialize the switch states structure and the hardware
@@ -29,17 +49,98 @@ void initialize_raspi_switch_states( SWITCH_STATES *raspi_switches ) {
     return;
 }
 
+// Wait until the pin has read high for all of SWITCH_DEBOUNCE_US
+static void switch_settle_high( int pin ) {
+    int stable_us = 0;
+
+    while (stable_us < SWITCH_DEBOUNCE_US) {
+        delayMicroseconds( SWITCH_SAMPLE_US );
+        if (digitalRead( pin ) == HIGH) {
+            stable_us += SWITCH_SAMPLE_US;
+        } else {
+            stable_us = 0;
+        }
+    }
+}
+
+// Runs on every edge of a switch pin, on the pin's own wiringPi thread,
+// so it can take its time.  The first edge that finds the pin low (the
+// switches pull it to ground) is a press, counted straight away; then
+// we wait here until the switch has been let go and the pin has settled
+// high.  Edges while we wait, from the bounce of the press or of the
+// release, just run this again afterwards and find the pin high.
+static void switch_edge( int sw ) {
+    uint64_t one = 1;
+
+    if (digitalRead( switch_pins[sw] ) != LOW)
+        return;
+    // the stamp is published by the release on presses, and can't be
+    // written again until the switch has been let go
+    clock_gettime( CLOCK_MONOTONIC, &pressed_at[sw] );
+    atomic_fetch_add_explicit( &presses[sw], 1, memory_order_release );
+    if (write( switch_fd, &one, sizeof(one) ) != sizeof(one)) {
+        // only fails if the counter would overflow, and then the
+        // event loop is already due to wake up
+    }
+    switch_settle_high( switch_pins[sw] );
+}
+
+static void feed_hold_isr( void ) { switch_edge( SW_FEED_HOLD ); }
+static void resume_isr( void )    { switch_edge( SW_RESUME );    }
+static void reset_isr( void )     { switch_edge( SW_RESET );     }
+static void reconnect_isr( void ) { switch_edge( SW_RECONNECT ); }
+
+
+// Hook the switch pins up to their interrupt handlers.  Returns the fd
+// that becomes readable when a switch is pressed, or -1 on failure.
+int enable_raspi_switch_interrupts( void ) {
+    switch_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if (switch_fd < 0) {
+        LOG_ERRNO( "eventfd" );
+        return -1;
+    }
+    if (wiringPiISR( SWITCH_FEED_HOLD, INT_EDGE_BOTH, feed_hold_isr ) < 0 ||
+        wiringPiISR( SWITCH_RESUME,    INT_EDGE_BOTH, resume_isr    ) < 0 ||
+        wiringPiISR( SWITCH_RESET,     INT_EDGE_BOTH, reset_isr     ) < 0 ||
+        wiringPiISR( SWITCH_RECONNECT, INT_EDGE_BOTH, reconnect_isr ) < 0) {
+        LOG_ERROR( "Could not set up switch interrupts" );
+        close( switch_fd );
+        switch_fd = -1;
+        return -1;
+    }
+    return switch_fd;
+}
+
+
+// Current state of one switch.  A press counted since the last call is
+// reported as a fresh press even if the switch has been let go again,
+// and at says when it started.
+static void read_switch( int sw, short int *state, short int *prev_state, struct timespec *at ) {
+    unsigned int count = atomic_load_explicit( &presses[sw], memory_order_acquire );
+
+    *prev_state = *state;
+    *state      = digitalRead( switch_pins[sw] );
+    if (count != presses_seen[sw]) {
+        presses_seen[sw] = count;
+        *prev_state = 1;
+        *state      = 0;
+        *at         = pressed_at[sw];
+    } else if (!*state && *prev_state) {
+        clock_gettime( CLOCK_MONOTONIC, at );   // low, but the ISR hasn't seen it yet
+    }
+}
+
 // read the switch states into the data structure
 void read_raspi_switches( SWITCH_STATES *raspi_switches ) {
-    raspi_switches->prev_feed_hold            = raspi_switches->feed_hold;
-    raspi_switches->prev_resume               = raspi_switches->resume;
-    raspi_switches->prev_reset                = raspi_switches->reset;
-    raspi_switches->prev_reconnect_requested  = raspi_switches->reconnect_requested;
-
-    raspi_switches->feed_hold            = digitalRead( SWITCH_FEED_HOLD );
-    raspi_switches->resume               = digitalRead( SWITCH_RESUME    );
-    raspi_switches->reset                = digitalRead( SWITCH_RESET     );
-    raspi_switches->reconnect_requested  = digitalRead( SWITCH_RECONNECT );
+    uint64_t count;
+
+    if (read( switch_fd, &count, sizeof(count) ) != sizeof(count)) {
+        // no press since last time
+    }
+    read_switch( SW_FEED_HOLD, &raspi_switches->feed_hold,           &raspi_switches->prev_feed_hold,           &raspi_switches->feed_hold_at );
+    read_switch( SW_RESUME,    &raspi_switches->resume,              &raspi_switches->prev_resume,              &raspi_switches->resume_at );
+    read_switch( SW_RESET,     &raspi_switches->reset,               &raspi_switches->prev_reset,               &raspi_switches->reset_at );
+    read_switch( SW_RECONNECT, &raspi_switches->reconnect_requested, &raspi_switches->prev_reconnect_requested, &raspi_switches->reconnect_at );
     return;
 }
 
@@ -1,6 +1,7 @@
 #ifndef RASPI_SWITCHES_H
 #define RASPI_SWITCHES_H
 
+#include <time.h>
 
 typedef struct {
     short int feed_hold;
@@ -11,6 +12,10 @@ typedef struct {
     short int prev_resume;
     short int prev_reset;
     short int prev_reconnect_requested;
+    struct timespec feed_hold_at;        // CLOCK_MONOTONIC time of the edge
+    struct timespec resume_at;           // that started the latest press
+    struct timespec reset_at;
+    struct timespec reconnect_at;
 } SWITCH_STATES;
 
 #define SWITCH_FEED_HOLD            12
@@ -18,8 +23,15 @@ typedef struct {
 #define SWITCH_RESET                14
 #define SWITCH_RECONNECT            5
 
+// A press counts on its first falling edge; after that the pin has to
+// read high for this long before another one can, so the bounce of a
+// press and of its release are ignored
+#define SWITCH_DEBOUNCE_US          20000
+#define SWITCH_SAMPLE_US            1000
+
 
 void initialize_raspi_switch_states( SWITCH_STATES *raspi_switches );
+int  enable_raspi_switch_interrupts( void );
 void read_raspi_switches( SWITCH_STATES *switch_states );
 
 #endif   /* RASPI_SWITCHES_H - do not put anything below this line! */
@@ -0,0 +1,84 @@
+#define _GNU_SOURCE                 // pthread_setaffinity_np
+#include "realtime.h"
+#include "stats.h"
+#include "log.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static long long probe_expected_us;     // when the probe timer last should have fired
+static void (*probe_record)( long long late_us );
+
+
+// Keep everything we have and will have in RAM.  Called once, before
+// any thread is started, so their stacks are covered too.
+int realtime_lock_memory( void ) {
+    if (mlockall( MCL_CURRENT | MCL_FUTURE ) < 0) {
+        LOG_ERRNO( "mlockall" );
+        return 1;
+    }
+    return 0;
+}
+
+
+// Make the calling thread SCHED_FIFO at priority (0 leaves it alone) and
+// run it only on cpu (-1 for any).  Returns 0, or 1 if either failed.
+int realtime_thread( int priority, int cpu ) {
+    struct sched_param param;
+    cpu_set_t cpus;
+    int err;
+
+    if (priority > 0) {
+        memset( &param, 0, sizeof(param) );
+        param.sched_priority = priority;
+        err = pthread_setschedparam( pthread_self(), SCHED_FIFO, &param );
+        if (err) {
+            LOG_ERROR( "SCHED_FIFO priority %d: %s", priority, strerror( err ) );
+            return 1;
+        }
+        LOG_INFO( "Input running at SCHED_FIFO priority %d", priority );
+    }
+    if (cpu >= 0) {
+        CPU_ZERO( &cpus );
+        CPU_SET( cpu, &cpus );
+        err = pthread_setaffinity_np( pthread_self(), sizeof(cpus), &cpus );
+        if (err) {
+            LOG_ERROR( "Pinning to CPU %d: %s", cpu, strerror( err ) );
+            return 1;
+        }
+        LOG_INFO( "Input pinned to CPU %d", cpu );
+    }
+    return 0;
+}
+
+
+// Event loop handler for the probe timer.  The timer runs on a fixed
+// grid from when it was armed, so after n expirations it should have
+// fired at exactly n periods; anything past that is latency.
+static void jitter_probe_event( int fd, unsigned int events, void *data ) {
+    unsigned long long expirations;
+
+    (void)events;
+    (void)data;
+    expirations = timer_ack( fd );
+    probe_expected_us += expirations * JITTER_PROBE_US;
+    probe_record( stats_now_us() - probe_expected_us );
+}
+
+
+// Start the probe in the loop of the thread being measured.  Each
+// sample goes to record, which must get it to the stats on the thread
+// that owns them; the histograms are not safe to share.
+int jitter_probe_start( EVENT_LOOP *loop, void (*record)( long long late_us ) ) {
+    int fd = timer_new();
+
+    if (fd < 0 || event_loop_add( loop, fd, EPOLLIN, jitter_probe_event, NULL ))
+        return 1;
+    probe_record = record;
+    probe_expected_us = stats_now_us();
+    timer_set( fd, JITTER_PROBE_US );
+    LOG_INFO( "Measuring wake up jitter every %d us", JITTER_PROBE_US );
+    return 0;
+}
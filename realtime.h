@@ -0,0 +1,19 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include "event_loop.h"
+
+// Real-time mode for the thread that reads the jog controller: SCHED_FIFO
+// so a busy SPJS or browser can't deschedule it, memory locked so it
+// never waits for a page fault, and optionally pinned to one CPU.  Needs
+// root, or CAP_SYS_NICE and enough RLIMIT_MEMLOCK.
+//
+// The jitter probe measures what that buys: a timer that should fire
+// every JITTER_PROBE_US, and a histogram of how late each wake up was.
+#define JITTER_PROBE_US 1000
+
+int realtime_lock_memory( void );
+int realtime_thread( int priority, int cpu );
+int jitter_probe_start( EVENT_LOOP *loop, void (*record)( long long late_us ) );
+
+#endif   /* REALTIME_H - do not put anything below this line! */
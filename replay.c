@@ -0,0 +1,186 @@
+#include "replay.h"
+#include "log.h"
+#include "stats.h"
+#include "shuttle.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static int                 record_fd = -1;
+static struct input_event* events = NULL;       // the stream being replayed
+static int                 num_events = 0;
+static int                 next_event = 0;
+static double              replay_speed;        // 0 for flat out
+static long long           replay_t0;           // first event's timestamp, us
+static long long           replay_start_us;     // when the replay started
+static int                 replay_timer_fd = -1;
+static REPLAY_HANDLER      replay_handler;
+static REPLAY_IDLE         replay_idle;
+
+
+static long long ev_us( const struct input_event *ev ) {
+    return ev->time.tv_sec * 1000000LL + ev->time.tv_usec;
+}
+
+
+// Start saving every event read from the jog controller to path
+int record_open( const char *path ) {
+    record_fd = open( path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if (record_fd < 0) {
+        LOG_ERRNO( path );
+        return 1;
+    }
+    return 0;
+}
+
+void record_event( const struct input_event *ev ) {
+    if (record_fd < 0)
+        return;
+    if (write( record_fd, ev, sizeof(*ev) ) != sizeof(*ev)) {
+        LOG_ERRNO( "recording" );
+        close( record_fd );
+        record_fd = -1;
+    }
+}
+
+
+// Read a recording made with record_open() into memory
+int replay_load( const char *path ) {
+    struct stat st;
+    int fd = open( path, O_RDONLY | O_CLOEXEC );
+
+    if (fd < 0 || fstat( fd, &st ) < 0) {
+        LOG_ERRNO( path );
+        if (fd >= 0) close( fd );
+        return 1;
+    }
+    num_events = st.st_size / sizeof(struct input_event);
+    events = malloc( num_events * sizeof(struct input_event) + 1 );
+    if (!events || read( fd, events, num_events * sizeof(struct input_event) ) !=
+                   (ssize_t)(num_events * sizeof(struct input_event))) {
+        LOG_ERROR( "Could not read recording %s", path );
+        close( fd );
+        return 1;
+    }
+    close( fd );
+    LOG_INFO( "Loaded %d events from %s", num_events, path );
+    return 0;
+}
+
+
+// add one event to the made up stream, us after the previous one
+static void synth( long long *t, long gap_us, int type, int code, int value ) {
+    struct input_event *ev = &events[num_events++];
+
+    *t += gap_us;
+    ev->time.tv_sec  = *t / 1000000;
+    ev->time.tv_usec = *t % 1000000;
+    ev->type  = type;
+    ev->code  = code;
+    ev->value = value;
+}
+
+// Each round picks the next axis, spins the jog wheel 40 clicks one
+// way and back, then pushes the shuttle ring out to full and back in
+// both directions, with roughly the timing of a person doing it.
+int replay_synthetic( int rounds ) {
+    static const int axis_buttons[] = { X_AXIS_BUTTON, Y_AXIS_BUTTON, Z_AXIS_BUTTON };
+    const int per_round = 2*2 + 80*2 + 28*2;
+    long long t = 0;
+    int r, i, jog = 1, step;
+
+    events = malloc( rounds * per_round * sizeof(struct input_event) );
+    if (!events) {
+        LOG_ERROR( "Out of memory for %d rounds of events", rounds );
+        return 1;
+    }
+    num_events = 0;
+    for (r = 0; r < rounds; r++) {
+        synth( &t, 200000, EV_KEY, axis_buttons[r % 3], 1 );
+        synth( &t, 0,      EV_SYN, SYN_REPORT, 0 );
+        synth( &t, 80000,  EV_KEY, axis_buttons[r % 3], 0 );
+        synth( &t, 0,      EV_SYN, SYN_REPORT, 0 );
+        for (i = 0; i < 80; i++) {
+            step = i < 40 ? 1 : -1;
+            jog = (jog + step) & 0xff;
+            synth( &t, 8000, EV_REL, EVENT_CODE_JOG, jog );
+            synth( &t, 0,    EV_SYN, SYN_REPORT, 0 );
+        }
+        for (i = 1; i <= 28; i++) {
+            // 0..7..0, then 0..-7..0
+            step = i <= 7 ? i : i <= 14 ? 14 - i : i <= 21 ? 14 - i : i - 28;
+            synth( &t, 100000, EV_REL, EVENT_CODE_SHUTTLE, step );
+            synth( &t, 0,      EV_SYN, SYN_REPORT, 0 );
+        }
+    }
+    LOG_INFO( "Made up %d events", num_events );
+    return 0;
+}
+
+
+// Feed the events that are due.  Flat out, the next report (everything
+// up to an EV_SYN) only goes in once the last one's commands are out.
+static void replay_timer_event( int fd, unsigned int events_mask, void *data ) {
+    struct input_event ev;
+    long long due, now;
+
+    (void)events_mask;
+    (void)data;
+    timer_ack( fd );
+
+    while (next_event < num_events) {
+        if (replay_speed > 0) {
+            due = replay_start_us + (ev_us( &events[next_event] ) - replay_t0) / replay_speed;
+            now = stats_now_us();
+            if (due > now) {
+                timer_once( replay_timer_fd, due - now );
+                return;
+            }
+        } else if (!replay_idle()) {
+            timer_once( replay_timer_fd, REPLAY_POLL_US );
+            return;
+        }
+
+        do {
+            // stamp it as if it had just been read from the device
+            ev = events[next_event++];
+            now = stats_now_us();
+            ev.time.tv_sec  = now / 1000000;
+            ev.time.tv_usec = now % 1000000;
+            replay_handler( ev );
+        } while (replay_speed <= 0 && next_event < num_events && ev.type != EV_SYN);
+    }
+}
+
+
+int replay_start( EVENT_LOOP *loop, double speed, REPLAY_HANDLER handler, REPLAY_IDLE idle ) {
+    if (num_events == 0) {
+        LOG_ERROR( "Nothing to replay" );
+        return 1;
+    }
+    replay_speed   = speed;
+    replay_handler = handler;
+    replay_idle    = idle;
+    replay_t0      = ev_us( &events[0] );
+    replay_start_us = stats_now_us();
+    next_event     = 0;
+
+    replay_timer_fd = timer_new();
+    if (replay_timer_fd < 0 ||
+        event_loop_add( loop, replay_timer_fd, EPOLLIN, replay_timer_event, NULL )) {
+        return 1;
+    }
+    timer_once( replay_timer_fd, 1 );
+    return 0;
+}
+
+// True once every event has been handed over
+int replay_done( void ) {
+    return next_event >= num_events;
+}
+
+int replay_count( void ) {
+    return num_events;
+}
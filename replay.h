@@ -0,0 +1,26 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <linux/input.h>
+#include "event_loop.h"
+
+// Recording saves the raw struct input_event stream read from the jog
+// controller.  Replaying feeds a recording (or a made up stream) back
+// into the pipeline with the original timing, sped up, or as fast as
+// the transport will take it.
+#define REPLAY_POLL_US  100     // how often a flat out replay looks for an idle transport
+
+// Where replayed events go
+typedef void (*REPLAY_HANDLER)( struct input_event ev );
+// True once the previous events' commands have all gone out
+typedef int (*REPLAY_IDLE)( void );
+
+int  record_open( const char *path );
+void record_event( const struct input_event *ev );
+int  replay_load( const char *path );
+int  replay_synthetic( int rounds );
+int  replay_start( EVENT_LOOP *loop, double speed, REPLAY_HANDLER handler, REPLAY_IDLE idle );
+int  replay_done( void );
+int  replay_count( void );
+
+#endif   /* REPLAY_H - do not put anything below this line! */
@@ -101,12 +101,17 @@
 #define Z_AXIS_BUTTON 262
 #define A_AXIS_BUTTON 263
 #define INCREMENT_BUTTON 264
+#define B_AXIS_BUTTON 265       // the ShuttlePRO's extra buttons
+#define C_AXIS_BUTTON 266
 
 typedef enum {
     X_AXIS_ACTIVE = 0,
     Y_AXIS_ACTIVE = 1,
     Z_AXIS_ACTIVE = 2,
     A_AXIS_ACTIVE = 3,
+    B_AXIS_ACTIVE = 4,
+    C_AXIS_ACTIVE = 5,
+    NUM_AXES              // make sure this is last
 } ACTIVE_AXIS;
 
 typedef enum {
@@ -14,6 +14,8 @@
  capable of sending gcode directly to GRBL
  Note that at the time of this writing, bCNC is specific to GRBL only.  bCNC does not work with TinyG.
 
+ Without either, it can also open the controller's serial port itself.
+
  Interface to Shuttle Contour Xpress based on "Contour ShuttlePro
  v2 interface" by Eric Messick.
 
@@ -27,17 +29,72 @@
 #include <wiringPi.h>
 #endif
 
-#include "websocket.h"
+#include "transport.h"
+#include "event_loop.h"
+#include "planner.h"
+#include "input_queue.h"
+#include "stats.h"
+#include "log.h"
+#include "replay.h"
+#include "mock.h"
+#include "config.h"
+#include "gcode.h"
+#include "controller.h"
+#include "hotplug.h"
+#include "publish.h"
+#include "metrics.h"
+#include "realtime.h"
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/signalfd.h>
 
+// The first group can also be set in a config file or on the command
+// line (see README); the values here are the defaults.
 #define CNC_HOST      "localhost"         // Hostname where SPJS or bCNC is running
 #define CNC_PORT      "8989"              // Port for SPJS or bCNC.  Typically 8989 for Chillipeppr and 8080 for bCNC
 #define DEVICE_PATH   "/dev/ttyACM0"      // Path for SPJS to connect to GRBL or TinyG.  Not used for bCNC
 #define TINYG         0                   // set to 1 if you are using a TinyG
 #define BCNC          0                   // set to 1 if you are using bCNC instead of Chilipeppr
-#define CYCLE_TIME_MICROSECONDS 100000    // time of each main loop iteration
+#define DIRECT_SERIAL 0                   // set to 1 to open DEVICE_PATH ourselves, without SPJS
+#define SERIAL_BAUD   115200              // its speed, for DIRECT_SERIAL
+#define PUBLISH_PATH  ""                  // Unix socket to publish the pendant state on, "" for none
+#define METRICS_PORT  ""                  // TCP port to serve Prometheus metrics on, "" for none
+#define BATCH_COMMANDS BATCH_NONE         // SPJS framing: BATCH_NONE, BATCH_SEND or BATCH_SENDJSON
+#define JOG_COALESCE_MICROSECONDS 0       // sum jog clicks arriving within this window into one move (0 = off)
+#define CYCLE_TIME_MICROSECONDS 100000    // interval between continuous shuttle resends
+#define SPJS_MAX_QUEUED 2                 // skip shuttle resends while SPJS holds more lines than this for the port
+#define SPJS_REPORT_TIMEOUT_US 1000000    // forget SPJS's queue count if it hasn't been updated for this long
+#define DEVICE_RETRY_MICROSECONDS 1000000 // how often to look for a missing jog controller (udev normally finds it first)
+#define CNC_RETRY_MIN_MICROSECONDS 100000 // first SPJS reconnect delay, doubled after each failure ...
+#define CNC_RETRY_MAX_MICROSECONDS 5000000 // ... up to this
+#define CNC_CONNECT_TIMEOUT_MICROSECONDS 5000000 // give up on a websocket handshake (or a silent controller) after this long
+#define THREADED_INPUT 0                  // set to 1 to read the jog controller and switches in their own thread
+#define REALTIME_PRIORITY 0               // SCHED_FIFO priority (1-99) for reading the jog controller, 0 for none
+#define CPU_AFFINITY  -1                  // CPU to pin reading the jog controller to, -1 for any
 #define MAX_FEED_RATE 1500.0              // (unit per minute - initially tested with millimeters)
 #define OVERSHOOT     1.06                // amount of overshoot for shuttle wheel
 
+// Streaming mode (SPJS only): instead of re-sending a fixed size shuttle
+// segment every cycle, size and pace segments from the "ok" replies and
+// the GRBL Bf: / TinyG qr planner reports SPJS relays back to us, so only
+// a bounded amount of motion is ever queued ahead of the machine.
+#define STREAM_PACING            0        // set to 1 to pace shuttle segments from controller feedback
+#define STREAM_SEGMENTS          3        // number of shuttle segments kept queued ahead
+#define STREAM_MIN_LOOKAHEAD_US  150000   // queued shuttle motion, lower bound
+#define STREAM_MAX_LOOKAHEAD_US  400000   // queued shuttle motion, upper bound (limits coast after release)
+#define STREAM_MAX_PENDING_LINES 8        // unacknowledged lines allowed between us and the controller
+#define STREAM_MIN_FREE_BLOCKS   2        // don't add segments when the planner has fewer free blocks
+#define STREAM_TICK_MICROSECONDS 20000    // how often to top up the look-ahead while shuttling
+#define STREAM_ACK_TIMEOUT_US    1000000  // stop waiting for lost acknowledgements after this long
+
+// GRBL 1.1 jogging (SPJS only): shuttle moves go out as $J= jogs, and the
+// real-time jog cancel stops them the moment the wheel returns to centre.
+// GRBL throws away the jogs still queued, so nothing coasts on after
+// release and the segments need no OVERSHOOT.
+#define GRBL_JOG                 0        // set to 1 for $J= shuttle jogs with a GRBL 1.1
+
 // Each press of the increment button will toggle through 4 speed / distance
 // increments. Use the defines below to adjust the distance moved by 
 // each increment of the jog dial.
@@ -47,40 +104,433 @@
 #define INCREMENT3 0.1
 #define INCREMENT4 1.0
 
+// Jog acceleration: when the dial is spun faster than JOG_ACCEL_THRESHOLD
+// clicks per second, each click moves several increments instead of one,
+// growing by JOG_ACCEL_GAIN increments for every further threshold's worth
+// of speed, up to JOG_ACCEL_MAX.  Turned slowly, a click is still exactly
+// one increment.
+#define JOG_ACCEL           0             // set to 1 to turn jog acceleration on
+#define JOG_ACCEL_THRESHOLD 8.0           // clicks per second
+#define JOG_ACCEL_GAIN      2.0           // increments per threshold's worth of speed
+#define JOG_ACCEL_MAX       50.0          // increments per click at most
+#define JOG_ACCEL_IDLE_US   250000        // a pause this long starts the next spin from scratch
+
+// Jog controllers one process can serve, each given on the command line
+// as <device>[=<serial port>]
+#define MAX_DEVICES   TRANSPORT_MAX_PORTS
+#define DEVICE_READ_EVENTS 64             // evdev events taken from the kernel per read()
+#define DEVICE_FRAME_EVENTS 16            // events one SYN_REPORT frame may hold before it is handled anyway
+
 typedef struct input_event EV;
-unsigned short jogvalue = 0xffff;
-int            shuttlevalue = 0xffff;
-struct timeval last_shuttle;
-int            need_synthetic_shuttle;
 
+CONFIG config = {
+    CNC_HOST, CNC_PORT, DEVICE_PATH, PUBLISH_PATH, METRICS_PORT, TINYG, BCNC, GRBL_JOG, DIRECT_SERIAL, SERIAL_BAUD,
+    MAX_FEED_RATE, OVERSHOOT,
+    { INCREMENT1, INCREMENT2, INCREMENT3, INCREMENT4 },
+    JOG_ACCEL, JOG_ACCEL_THRESHOLD, JOG_ACCEL_GAIN, JOG_ACCEL_MAX,
+    REALTIME_PRIORITY, CPU_AFFINITY,
+    -1,                                 // log level: keep SHUTTLECP_LOG's
+};
+
+// Commands built once by prepare_commands(), so a jog click or shuttle
+// step just copies one.  Indexed by ACTIVE_AXIS, ACTIVE_SPEED, the
+// shuttle step and the direction (0 back, 1 forward).
+#define SHUTTLE_STEPS 8
+const char    axis_letters[NUM_AXES] = { 'X', 'Y', 'Z', 'A', 'B', 'C' };
+// the axis each button from X_AXIS_BUTTON to C_AXIS_BUTTON selects,
+// -1 for the increment button in the middle of them
+const signed char button_axes[C_AXIS_BUTTON - X_AXIS_BUTTON + 1] = {
+    X_AXIS_ACTIVE, Y_AXIS_ACTIVE, Z_AXIS_ACTIVE, A_AXIS_ACTIVE, -1, B_AXIS_ACTIVE, C_AXIS_ACTIVE,
+};
+char          jog_cmds[NUM_AXES][NUM_MOTION_SPEEDS][2][MAX_CMD_LENGTH];
+char          shuttle_cmds[NUM_AXES][NUM_MOTION_SPEEDS][SHUTTLE_STEPS][2][MAX_CMD_LENGTH];
+char          axis_broadcasts[NUM_AXES][MAX_CMD_LENGTH];
+char          speed_broadcasts[NUM_MOTION_SPEEDS][MAX_CMD_LENGTH];
+char          jog_prefixes[NUM_AXES][16];        // "G91 G0 X", for coalesced moves
+
+// Everything kept per jog controller.  Each one drives the machine on
+// its own serial port, but they all share the transport and the event
+// loop.
+typedef struct {
+    const char    *path;                // the evdev device
+    const char    *serial;              // serial port its machine is on
+    int           index;                // in devices[]
+    int           fd;                   // -1 while it isn't open
+    short int     connected;
+    short int     open_failed;          // the last attempt to open it failed, and was logged
+    unsigned short jogvalue;
+    int           shuttlevalue;
+    struct timeval last_shuttle;
+    int           need_synthetic_shuttle;
+    ACTIVE_AXIS   active_axis;
+    ACTIVE_SPEED  active_speed;
+    Queue         cmd_queue;
+    char          lastcmd[MAX_CMD_LENGTH];
+    short int     continuously_send_last_command;
+    int           resend_timer_fd;
+    int           jog_timer_fd;
+    ACTIVE_AXIS   jog_axis;             // axis of the jog clicks being coalesced
+    float         jog_increment;        // signed distance of one of those clicks, unaccelerated
+    int           jog_clicks;           // clicks summed up but not yet queued
+    double        jog_distance;         // and how far they add up to
+    long long     event_us;             // timestamp of the event being handled
+    long long     last_click_us;        // timestamp of the previous jog click
+    int           last_click_direction;
+    long          click_interval_us;    // smoothed time between clicks, 0 if not spinning
+    short int     jog_window_open;
+    PLANNER_STATE planner;
+    char          stream_axis;
+    float         stream_feed;
+    int           stream_direction;
+    short int     stop_pending;         // stop the shuttle again once our lines have drained
+    struct timespec stop_busy_at;       // when our own output last held that up
+    int           broadcast_axis;       // what the other SPJS clients were last told, -1 if unsure
+    int           broadcast_speed;
+    EV            frame[DEVICE_FRAME_EVENTS]; // events since the last SYN_REPORT
+    int           frame_len;
+    short int     frame_dropped;        // the kernel dropped events, skip to the next SYN_REPORT
+} DEVICE_STATE;
+
+DEVICE_STATE  devices[MAX_DEVICES];
+int           num_devices = 0;
+const CONTROLLER_PROFILE *controller = &controller_grbl;
+const TRANSPORT *transport = &transport_spjs;
+TRANSPORT_SETTINGS transport_settings;
 #if GPIO_SUPPORT
 LED_STATES    led_states;
 SWITCH_STATES raspi_switches;
 #endif
 short int     cnc_connected      = 0;
+short int     cnc_connecting     = 0;   // transport->connect() has yet to finish
+short int     cnc_retry_pending  = 0;   // cnc_retry_timer_fd will start the next attempt
+long          cnc_retry_us       = CNC_RETRY_MIN_MICROSECONDS;
+int           cnc_retry_timer_fd = -1;
 short int     reconnect_requested      = 0;
-short int     shuttle_device_connected = 0;
-ACTIVE_AXIS   active_axis              = X_AXIS_ACTIVE;
-ACTIVE_SPEED  active_speed             = MOTION_SPEED_4;
-Queue         cmd_queue;
-char          lastcmd[MAX_CMD_LENGTH];
-short int     continuously_send_last_command;
+EVENT_LOOP    event_loop;
+EVENT_LOOP    *device_loop;             // the loop the jog controllers are read in
+int           device_retry_timer_fd = -1;
+int           next_device = 0;          // whose turn it is to send first
+INPUT_QUEUE   input_queue;              // input thread -> main thread, THREADED_INPUT only
+EVENT_LOOP    input_loop;               // the input thread's own event loop
+short int     replaying = 0;            // events come from --replay or --synthetic
+short int     jitter_probe = 0;         // --jitter: measure how late the input thread wakes up
 
+// Only in the benchmark build, see bench_alloc.c
+extern unsigned long bench_allocations( void ) __attribute__(( weak ));
 
-// A utility procedure to send a command generated by one of the 
-// switch interrupt service routines below.
-void generic_switch_command( const char *sw_name, char cmdchar ) {
+
+// Feed rate for a shuttle step: full shuttle (7) at the largest
+// increment is MAX_FEED_RATE, smaller increments scale it down.
+float shuttle_feed( float increment, int step ) {
+    return increment * step * (config.max_feed_rate / (7.0*config.increments[MOTION_SPEED_4]));
+}
+
+
+// prefix followed by distance and a return to absolute mode: the
+// relative move every jog click is
+void relative_move( char *cmd, const char *prefix, float distance ) {
+    int len;
+
+    len = gcode_append( cmd, 0, MAX_CMD_LENGTH, prefix );
+    len = gcode_append_number( cmd, len, MAX_CMD_LENGTH, distance );
+    gcode_append( cmd, len, MAX_CMD_LENGTH, "\nG90\n" );
+}
+
+
+// Build every command a click or a shuttle step can produce, once the
+// configuration is known.  Shuttle steps are sized from the cycle time
+// so that the next command is queued just before the machine starts
+// to decelerate, which is why we have the overshoot factor.  Controllers
+// that can stop a move early get segments of exactly one cycle.
+void prepare_commands() {
+    double overshoot = controller->overshoot ? config.overshoot : 1.0;
+    float speed, distance;
+    int a, i, step, dir;
+
+    for (a = 0; a < NUM_AXES; a++) {
+        snprintf( jog_prefixes[a], sizeof(jog_prefixes[a]), "G91 G0 %c", axis_letters[a] );
+        snprintf( axis_broadcasts[a], MAX_CMD_LENGTH, "{\"id\":\"shuttlexpress\", \"action\":\"%c\"}", tolower(axis_letters[a]) );
+        for (i = 0; i < NUM_MOTION_SPEEDS; i++) {
+            for (dir = 0; dir < 2; dir++) {
+                distance = config.increments[i] * (dir ? 1 : -1);
+                relative_move( jog_cmds[a][i][dir], jog_prefixes[a], distance );
+                for (step = 0; step < SHUTTLE_STEPS; step++) {
+                    speed    = shuttle_feed( config.increments[i], step );
+                    distance = (speed/60.0) * (CYCLE_TIME_MICROSECONDS * overshoot / 1000000.0) * (dir ? 1 : -1);
+                    controller->shuttle_move( shuttle_cmds[a][i][step][dir], axis_letters[a], speed, distance );
+                }
+            }
+        }
+    }
+    for (i = 0; i < NUM_MOTION_SPEEDS; i++) {
+        snprintf( speed_broadcasts[i], MAX_CMD_LENGTH, "{\"id\":\"shuttlexpress\", \"action\":\"%.3fmm\"}", config.increments[i] );
+    }
+}
+
+
+// Streaming is only possible when we can hear back from the controller
+int stream_pacing() {
+    return STREAM_PACING && transport->feedback;
+}
+
+
+// Start (or restart) the timer that re-sends lastcmd while the shuttle
+// wheel is held, or stop it when enable is 0.  Restarting it whenever a
+// new shuttle command goes out keeps the resends evenly spaced.
+void set_resend_timer( DEVICE_STATE *dev, short int enable ) {
+    long interval = stream_pacing() ? STREAM_TICK_MICROSECONDS : CYCLE_TIME_MICROSECONDS;
+    timer_set( dev->resend_timer_fd, enable ? interval : 0 );
+}
+
+
+// Throw away everything dev has queued.  A broadcast may have been
+// among it, so the other clients may not know the axis and speed.
+void clear_cmd_queue( DEVICE_STATE *dev ) {
+    if (dev->cmd_queue.size > 0) {
+        dev->broadcast_axis  = -1;
+        dev->broadcast_speed = -1;
+    }
+    dev->cmd_queue.clear( &dev->cmd_queue );
+}
+
+
+// Throw away the moves dev has queued, but keep the sticky lines that
+// finish off a stop (TinyG's flush and resume).  The shuttle event that
+// follows a stop, often the wheel settling at centre in the same read,
+// must not leave the machine in feedhold.
+void clear_queued_moves( DEVICE_STATE *dev ) {
+    Queue *queue = &dev->cmd_queue;
+    QueueEntry *e;
+    int i, kept = 0;
+
+    for (i = 0; i < queue->size; i++) {
+        e = queue->at( queue, i );
+        if (e->sticky) {
+            if (kept != i) {
+                *queue->at( queue, kept ) = *e;
+            }
+            kept++;
+        }
+    }
+    if (kept < queue->size) {
+        dev->broadcast_axis  = -1;
+        dev->broadcast_speed = -1;
+    }
+    queue->size = kept;
+}
+
+
+// True if cmd is already the last thing waiting in the queue
+int queued_last( Queue *queue, const char *cmd ) {
+    QueueEntry *e;
+
+    if (queue->size == 0)
+        return 0;
+    e = queue->at( queue, queue->size - 1 );
+    return e->type == CMD_GCODE && strcmp( e->cmd, cmd ) == 0;
+}
+
+
+// Queue a G-code command, remembering it for the shuttle resends
+void push_gcode( DEVICE_STATE *dev, const char *cmd ) {
+    strncpy( dev->lastcmd, cmd, MAX_CMD_LENGTH );
+    dev->lastcmd[MAX_CMD_LENGTH-1] = '\0';
+    dev->cmd_queue.push( &dev->cmd_queue, CMD_GCODE, cmd );
+}
+
+
+// Streaming mode: queue shuttle segments until the planner holds the
+// look-ahead we want.  Segments are sized from the measured controller
+// round trip, and nothing is added while SPJS or the controller still
+// has a backlog of our earlier lines.
+void stream_shuttle_segments( DEVICE_STATE *dev ) {
+    PLANNER_STATE *planner = &dev->planner;
+    char cmd[MAX_CMD_LENGTH];
+    long target_us, segment_us;
+    int queued_lines = 0;
+    float distance;
+
+    planner_check_stale( planner, STREAM_ACK_TIMEOUT_US );
+    target_us  = planner_lookahead_target( planner, STREAM_MIN_LOOKAHEAD_US, STREAM_MAX_LOOKAHEAD_US );
+    segment_us = target_us / STREAM_SEGMENTS;
+    distance   = (dev->stream_feed/60.0) * (segment_us / 1000000.0) * dev->stream_direction;
+
+    while (planner_lookahead_us( planner ) < target_us &&
+           planner->pending_lines + queued_lines + controller->move_lines <= STREAM_MAX_PENDING_LINES &&
+           (planner->blocks_free < 0 || planner->blocks_free > STREAM_MIN_FREE_BLOCKS)) {
+        controller->shuttle_move( cmd, dev->stream_axis, dev->stream_feed, distance );
+        push_gcode( dev, cmd );
+        queued_lines += controller->move_lines;
+        planner_motion_queued( planner, segment_us );
+        if (planner->blocks_free > 0) {
+            planner->blocks_free--; // until the next status report says otherwise
+        }
+    }
+}
+
+
+// Queue the clicks summed up so far as one move of the same total distance
+void flush_jog( DEVICE_STATE *dev ) {
     char cmd[MAX_CMD_LENGTH];
-    fprintf(stderr, "%s detected\n", sw_name);
-    if (!BCNC) {
-        snprintf( cmd, MAX_CMD_LENGTH, "send %s %c\n", DEVICE_PATH, cmdchar );
+
+    if (dev->jog_clicks) {
+        relative_move( cmd, jog_prefixes[dev->jog_axis], dev->jog_distance );
+        push_gcode( dev, cmd );
+        dev->jog_clicks = 0;
+        dev->jog_distance = 0;
+    }
+}
+
+
+// Throw away summed up clicks, for when the queue is being cleared anyway
+void discard_jog( DEVICE_STATE *dev ) {
+    dev->jog_clicks = 0;
+    dev->jog_distance = 0;
+    dev->jog_window_open = 0;
+    if (dev->jog_timer_fd >= 0) {
+        timer_once( dev->jog_timer_fd, 0 );
+    }
+}
+
+
+// How many increments this click should move, from how fast the dial
+// is turning.  The speed is worked out from the evdev timestamps of the
+// clicks, smoothed over the last few, so one early or late click doesn't
+// make the move jump.  A pause or a change of direction starts over.
+int jog_accel_clicks( DEVICE_STATE *dev, int direction ) {
+    long long interval = dev->event_us - dev->last_click_us;
+    double rate, factor;
+    int spinning = dev->last_click_us && direction == dev->last_click_direction &&
+                   interval > 0 && interval < JOG_ACCEL_IDLE_US;
+
+    dev->last_click_us        = dev->event_us;
+    dev->last_click_direction = direction;
+    if (!spinning) {
+        dev->click_interval_us = 0;
+        return 1;
+    }
+    if (dev->click_interval_us == 0) {
+        dev->click_interval_us = interval;
     } else {
-        snprintf( cmd, MAX_CMD_LENGTH, "/send %c", cmdchar );
+        dev->click_interval_us += (interval - dev->click_interval_us) / 4;
+    }
+
+    rate = 1000000.0 / dev->click_interval_us;
+    if (rate <= config.jog_accel_threshold)
+        return 1;
+    factor = 1 + config.jog_accel_gain * (rate / config.jog_accel_threshold - 1);
+    if (factor > config.jog_accel_max) {
+        factor = config.jog_accel_max;
+    }
+    // whole increments, so the machine stays on the increment's grid
+    return (int)(factor + 0.5);
+}
+
+
+// Jog click coalescing.  The first click of a burst goes out right away
+// so a single click has no added latency.  Further clicks on the same
+// axis in the same direction are summed until the window closes and
+// then sent as one move, so a fast spin turns into a few longer moves
+// while the total distance still matches the number of clicks.
+void queue_jog( DEVICE_STATE *dev, int direction ) {
+    const char *cmd = jog_cmds[dev->active_axis][dev->active_speed][direction > 0];
+    float increment = config.increments[dev->active_speed] * direction;
+    double distance = increment;
+    char accel_cmd[MAX_CMD_LENGTH];
+    int clicks = config.jog_accel ? jog_accel_clicks( dev, direction ) : 1;
+
+    if (clicks > 1) {
+        distance = (double)increment * clicks;
+        relative_move( accel_cmd, jog_prefixes[dev->active_axis], distance );
+        cmd = accel_cmd;
+    }
+
+    if (JOG_COALESCE_MICROSECONDS == 0) {
+        push_gcode( dev, cmd );
+        return;
+    }
+
+    if (dev->jog_window_open) {
+        if (dev->active_axis == dev->jog_axis && increment == dev->jog_increment) {
+            dev->jog_clicks++;
+            dev->jog_distance += distance;
+            return;
+        }
+        flush_jog( dev );   // a different move: send what we have first
+    }
+    push_gcode( dev, cmd );
+    dev->jog_axis        = dev->active_axis;
+    dev->jog_increment   = increment;
+    dev->jog_clicks      = 0;
+    dev->jog_distance    = 0;
+    dev->jog_window_open = 1;
+    timer_once( dev->jog_timer_fd, JOG_COALESCE_MICROSECONDS );
+}
+
+
+// Number of lines destined for the controller waiting in the queue.
+// Each one will be answered by an "ok" when the controller takes it.
+int queued_device_lines( Queue* queue ) {
+    QueueEntry* e;
+    const char* c;
+    int i, lines = 0;
+
+    for (i = 0; i < queue->size; i++) {
+        e = queue->at( queue, i );
+        if (e->type != CMD_GCODE)
+            continue;
+        for (c = e->cmd; *c; c++) {
+            if (*c == '\n')
+                lines++;
+        }
+    }
+    return lines;
+}
+
+
+// Send a real-time command to dev's machine, around its queue.  With bCNC
+// a request still in flight is abandoned for it.  Returns 0, or -1 if
+// it couldn't be sent.
+int send_realtime( DEVICE_STATE *dev, const char *cmd, const struct timespec *detected ) {
+    if (!cnc_connected)
+        return -1;
+    if (transport->send_realtime( dev->index, cmd, detected )) {
+        cnc_connected = 0;
+        return -1;
+    }
+    return 0;
+}
+
+
+// A utility procedure to send a command generated by one of the 
+// switch interrupt service routines below.  detected is when the
+// switch's first edge was seen, so the latency stats start there.
+// The switches act on every machine.
+void generic_switch_command( const char *sw_name, char cmdchar, const struct timespec *detected ) {
+    char realtime[2] = { cmdchar, '\0' };
+    DEVICE_STATE *dev;
+    int i;
+
+    // feed hold, resume and reset are real-time commands, so they go
+    // around the queue and out right now instead of waiting their turn
+    LOG_INFO( "%s detected", sw_name );
+    for (i = 0; i < num_devices; i++) {
+        dev = &devices[i];
+        clear_cmd_queue( dev );  // clear all other commands
+        discard_jog( dev );
+        dev->continuously_send_last_command = 0;
+        set_resend_timer( dev, 0 );
+    }
+    if (!cnc_connected)
+        return;
+
+    // bCNC is one machine however many controllers drive it
+    for (i = 0; i < (transport->one_machine ? 1 : num_devices); i++) {
+        if (send_realtime( &devices[i], realtime, detected )) {
+            LOG_ERROR( "Could not send %s", sw_name );
+            return;
+        }
     }
-    cmd_queue.clear(&cmd_queue);  // clear all other commands
-    continuously_send_last_command = 0;
-    cmd[MAX_CMD_LENGTH-1] = '\0';
-    cmd_queue.push( &cmd_queue, cmd );
 }
 
 #if GPIO_SUPPORT
@@ -92,142 +542,186 @@ void process_raspi_switches( SWITCH_STATES *sw )
     // then check and see if it is different from its previous state.
     if (!sw->feed_hold || !sw->resume || !sw->reset) {
         if (!sw->feed_hold && (sw->feed_hold != sw->prev_feed_hold)) {
-            generic_switch_command( "FEED_HOLD", '!');
+            generic_switch_command( "FEED_HOLD", '!', &sw->feed_hold_at );
         }
         if (!sw->resume && (sw->resume != sw->prev_resume)) {
-            generic_switch_command( "RESUME", '~');
+            generic_switch_command( "RESUME", '~', &sw->resume_at );
         }
         if (!sw->reset && (sw->reset != sw->prev_reset)) {
-            generic_switch_command( "RESET", 24);
+            generic_switch_command( "RESET", 24, &sw->reset_at );
         }
     }
 
     // Now check other switches that don't spawn commands
     if (!sw->reconnect_requested && (sw->reconnect_requested != sw->prev_reconnect_requested)) {
-        fprintf(stderr, "RECONNECT detected\n");
+        LOG_INFO( "RECONNECT detected" );
         reconnect_requested = 1;
     }
 }
+
+// Event loop handler for the switch interrupts.  In threaded mode the
+// new states are only passed on to the main thread.
+void switch_event( int fd, unsigned int events, void *data ) {
+    INPUT_MSG msg;
+
+    (void)fd;
+    (void)events;
+    (void)data;
+    read_raspi_switches( &raspi_switches );
+    if (THREADED_INPUT) {
+        msg.type = INPUT_SWITCHES;
+        msg.switches = raspi_switches;
+        while (input_queue_push( &input_queue, &msg )) {
+            usleep(1000);
+        }
+    } else {
+        process_raspi_switches( &raspi_switches );
+    }
+}
 #endif
 
 // A helper procedure to return the character used for each axis
 // and the current speed/increment level.
-void get_axis_and_speed( char* axis, float* speed ) {
-    switch (active_axis) {
-        case X_AXIS_ACTIVE: *axis = 'X'; break;
-        case Y_AXIS_ACTIVE: *axis = 'Y'; break;
-        case Z_AXIS_ACTIVE: *axis = 'Z'; break;
-        case A_AXIS_ACTIVE: *axis = 'A'; break;
-        default:            *axis = 'X'; break;
-    }
-    switch (active_speed) {
-        case MOTION_SPEED_1: *speed = INCREMENT1; break;
-        case MOTION_SPEED_2: *speed = INCREMENT2; break;
-        case MOTION_SPEED_3: *speed = INCREMENT3; break;
-        case MOTION_SPEED_4: *speed = INCREMENT4; break;
-        default:             *speed = INCREMENT2; break;
-    }
+void get_axis_and_speed( DEVICE_STATE *dev, char* axis, float* speed ) {
+    *axis  = axis_letters[dev->active_axis];
+    *speed = config.increments[dev->active_speed];
 }
 
 
 // Main event procedure whenever a button is pressed.
-void key(unsigned short code, unsigned int value)
+void key(DEVICE_STATE *dev, unsigned short code, unsigned int value)
 {
-    char axis;
-    float speed;
-    char cmd[MAX_CMD_LENGTH];
+    const char *cmd = NULL;
     short bcast_axis  = 0;
     short bcast_speed = 0;
 
     // Only work on value == 1, which is the button down event
     if (value == 1) {
-        switch (code) {
-            case X_AXIS_BUTTON: active_axis = X_AXIS_ACTIVE; bcast_axis = 1; break;
-            case Y_AXIS_BUTTON: active_axis = Y_AXIS_ACTIVE; bcast_axis = 1; break;
-            case Z_AXIS_BUTTON: active_axis = Z_AXIS_ACTIVE; bcast_axis = 1; break;
-            case A_AXIS_BUTTON: active_axis = A_AXIS_ACTIVE; bcast_axis = 1; break;
-            case INCREMENT_BUTTON: {
-                active_speed = (active_speed + 1) % NUM_MOTION_SPEEDS;
-                bcast_speed = 1;
-                break;
-            }
-            default:
-                fprintf(stderr, "key(%d, %d) out of range\n", code, value);
-                break;
+        if (code == INCREMENT_BUTTON) {
+            dev->active_speed = (dev->active_speed + 1) % NUM_MOTION_SPEEDS;
+            bcast_speed = 1;
+        } else if (code >= X_AXIS_BUTTON && code <= C_AXIS_BUTTON) {
+            dev->active_axis = button_axes[code - X_AXIS_BUTTON];
+            bcast_axis = 1;
+        } else {
+            LOG_WARN( "key(%d, %d) out of range", code, value );
         }
-        get_axis_and_speed( &axis, &speed );
-
-        // If we need to broadcast the active axis or speed, send that out.
-        if (!BCNC) { // Only perform the following for Chilipeppr
-            if (bcast_axis) {
-                snprintf( cmd, MAX_CMD_LENGTH, "broadcast {\"id\":\"shuttlexpress\", \"action\":\"%c\"}\n", tolower(axis) );
-            } else if (bcast_speed) {
-                snprintf( cmd, MAX_CMD_LENGTH, "broadcast {\"id\":\"shuttlexpress\", \"action\":\"%.3fmm\"}\n", speed );
+        // If we need to broadcast the active axis or speed, send that out,
+        // unless the other clients were already told.
+        if (transport->broadcasts) { // Only SPJS has other clients to tell
+            if (bcast_axis && dev->broadcast_axis != (int)dev->active_axis) {
+                cmd = axis_broadcasts[dev->active_axis];
+                dev->broadcast_axis = dev->active_axis;
+            } else if (bcast_speed && dev->broadcast_speed != (int)dev->active_speed) {
+                cmd = speed_broadcasts[dev->active_speed];
+                dev->broadcast_speed = dev->active_speed;
+            }
+            if (cmd) {
+                dev->cmd_queue.push( &dev->cmd_queue, CMD_BROADCAST, cmd );
+                LOG_DEBUG( "broadcast %s", cmd );
             }
-            cmd[MAX_CMD_LENGTH-1] = '\0';
-            cmd_queue.push( &cmd_queue, cmd );
-            fprintf(stderr, "%s", cmd);
         }
     }
 }
 
 
+// Whether nothing of ours is left that could start the machine again
+// after a stop, neither in SPJS's queue nor still on its way to SPJS
+// (a real-time command overtakes the frames we haven't written yet).
+// A QCnt of 0 only counts if SPJS reported it after our own output had
+// drained, or it may be about the lines before those.
+int stop_can_repeat( DEVICE_STATE *dev ) {
+    const struct timespec *report = &dev->planner.spjs_report;
+
+    if (transport->busy()) {
+        clock_gettime( CLOCK_MONOTONIC, &dev->stop_busy_at );
+        return 0;
+    }
+    if (report->tv_sec < dev->stop_busy_at.tv_sec ||
+        (report->tv_sec == dev->stop_busy_at.tv_sec && report->tv_nsec < dev->stop_busy_at.tv_nsec))
+        return 0;
+    return planner_spjs_queued( &dev->planner, SPJS_REPORT_TIMEOUT_US ) == 0;
+}
+
+
+// Stop a released shuttle move the way the controller profile says.
+// The real-time part goes out now; any lines go through the queue
+// after it, sticky so that only a switch or a lost connection can
+// clear them.  If the profile asks for it and some of our lines are still
+// in SPJS's queue or on their way there, the real-time part is repeated
+// once they are gone.
+void stop_shuttle( DEVICE_STATE *dev ) {
+    struct timespec now;
+
+    if (controller->stop_lines &&
+        dev->cmd_queue.push( &dev->cmd_queue, CMD_GCODE, controller->stop_lines ) == 0) {
+        dev->cmd_queue.at( &dev->cmd_queue, dev->cmd_queue.size - 1 )->sticky = 1;
+    }
+    if (!controller->stop_realtime)
+        return;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    planner_motion_cancelled( &dev->planner );
+    dev->stop_busy_at.tv_sec  = 0;
+    dev->stop_busy_at.tv_nsec = 0;
+    dev->stop_pending = controller->stop_after_drain &&
+                        !stop_can_repeat( dev );
+    if (send_realtime( dev, controller->stop_realtime, &now )) {
+        LOG_ERROR( "Could not stop the shuttle move" );
+    }
+}
+
+
 // Main event procedure whenever shuttle wheel is turned.
-void shuttle(int value)
+void shuttle(DEVICE_STATE *dev, int value)
 {
-    char cmd[MAX_CMD_LENGTH];
     char axis;
     float speed;
-    float distance;
     int direction;
+    int was_shuttling = dev->continuously_send_last_command;
 
     if (value < -7 || value > 7) {
-        fprintf(stderr, "shuttle(%d) out of range\n", value);
+        LOG_WARN( "shuttle(%d) out of range", value );
     } else {
-        fprintf(stderr, "Received shuttle command for value %d ???\n", value);
+        LOG_DEBUG( "Received shuttle command for value %d ???", value );
         direction = (value >= 0) ? 1 : -1;
-        gettimeofday(&last_shuttle, 0);
-        need_synthetic_shuttle = value != 0;
-        if( value != shuttlevalue ) {
-            shuttlevalue = value;
+        gettimeofday(&dev->last_shuttle, 0);
+        dev->need_synthetic_shuttle = value != 0;
+        if( value != dev->shuttlevalue ) {
+            dev->shuttlevalue = value;
         }
 
         // if we got a shuttle of zero (0), this is our indication to 
         // stop streaming commands. Since there is a bug and sometimes
         // the shuttle doesn't send the event for zero, we actually 
         // stop on 0 or 1.
-        cmd_queue.clear(&cmd_queue);  // when we are shuttling, never queue commands
+        clear_queued_moves( dev );  // when we are shuttling, never queue commands
+        discard_jog( dev );
         if ((value == 0) || (value == 1) || (value == -1)) {
-            continuously_send_last_command = 0;
-
-            // Sending the wipe (%) command to GRBL doesn't work, but this
-            // should help for TinyG.  In reality, for TinyG we should really send
-            // a feed hold, then a wipe, then a resume.  Hopefully someone can 
-            // implement and test this on a TinyG.  TODO
-            if (TINYG) {
-                snprintf( cmd, MAX_CMD_LENGTH, "send %s !%%\n", DEVICE_PATH );
-                cmd_queue.push( &cmd_queue, cmd );
+            dev->continuously_send_last_command = 0;
+            set_resend_timer( dev, 0 );
+
+            if (was_shuttling) {
+                stop_shuttle( dev );
             }
 
         } else {
-            continuously_send_last_command = 1;
-            get_axis_and_speed( &axis, &speed );
-
-            // We calculate how far we want to move based on our current increment
-            // setting and our current cycle time.  That way, we know roughly how
-            // far the machine will move and can have the next command queued up
-            // just before it starts to decelerate, which is why we have the
-            // overshoot factor.
-            speed = speed * direction * value * (MAX_FEED_RATE / (7.0*INCREMENT4));
-            distance = (speed/60.0) * (CYCLE_TIME_MICROSECONDS * OVERSHOOT / 1000000.0) * direction;
-            if (!BCNC) {
-                snprintf( cmd, MAX_CMD_LENGTH, "send %s G91 G1 F%.3f %c%.3f\nG90\n", DEVICE_PATH, speed, axis, distance );
-            } else {
-                snprintf( cmd, MAX_CMD_LENGTH, "http://%s:%s/send?gcode=G91G1F%.3f%c%.3f%%0DG90", CNC_HOST, CNC_PORT, speed, axis, distance );
+            dev->continuously_send_last_command = 1;
+            if (stream_pacing()) {
+                get_axis_and_speed( dev, &axis, &speed );
+                dev->stream_axis      = axis;
+                dev->stream_feed      = shuttle_feed( speed, value * direction );
+                dev->stream_direction = direction;
+                stream_shuttle_segments( dev );
+                set_resend_timer( dev, 1 );
+                return;
+            }
+            push_gcode( dev, shuttle_cmds[dev->active_axis][dev->active_speed][value * direction][direction > 0] );
+            if (!controller->overshoot && !was_shuttling) {
+                // segments don't overlap, so keep one ahead or the
+                // planner runs dry waiting for the next cycle's
+                dev->cmd_queue.push( &dev->cmd_queue, CMD_GCODE, dev->lastcmd );
             }
-            strncpy( lastcmd, cmd, MAX_CMD_LENGTH );
-            cmd[MAX_CMD_LENGTH-1] = lastcmd[MAX_CMD_LENGTH-1] = '\0';
-            cmd_queue.push( &cmd_queue, cmd );
+            set_resend_timer( dev, 1 );
         }
     }
 }
@@ -240,281 +734,1154 @@ void shuttle(int value)
 //
 // Note, this fails if jogvalue happens to be 0, as we don't see that
 // event either!
-void jog(unsigned int value)
+void jog(DEVICE_STATE *dev, unsigned int value)
 {
     int direction;
     struct timeval now;
     struct timeval delta;
-    char axis;
-    float distance;
-    char cmd[MAX_CMD_LENGTH];
 
     // I think the reason we want to skip the very first jog is
     // because we can't calculate direction until we get 2 jog
     // events. --FG
-    if ((jogvalue != 0xffff) && (jogvalue != value)) {
-        direction = ((value - jogvalue) & 0x80) ? -1 : 1;
-        get_axis_and_speed( &axis, &distance );
-        distance *= direction;
-        if (!BCNC) {
-            snprintf( cmd, MAX_CMD_LENGTH, "send %s G91 G0 %c%.3f\nG90\n", DEVICE_PATH, axis, distance );
-        } else {
-            snprintf( cmd, MAX_CMD_LENGTH, "http://%s:%s/send?gcode=G91G0%c%.3f%%0DG90", CNC_HOST, CNC_PORT, axis, distance );
-        }
-        strncpy( lastcmd, cmd, MAX_CMD_LENGTH );
-        cmd[MAX_CMD_LENGTH-1] = lastcmd[MAX_CMD_LENGTH-1] = '\0';
-	cmd_queue.push( &cmd_queue, cmd );
+    if ((dev->jogvalue != 0xffff) && (dev->jogvalue != value)) {
+        direction = ((value - dev->jogvalue) & 0x80) ? -1 : 1;
+        queue_jog( dev, direction );
     }
-    jogvalue = value;
+    dev->jogvalue = value;
 
     // We should generate a synthetic event for the shuttle going
     // to the home position if we have not seen one recently
-    if (need_synthetic_shuttle) {
+    if (dev->need_synthetic_shuttle) {
         gettimeofday( &now, 0 );
-        timersub( &now, &last_shuttle, &delta );
+        timersub( &now, &dev->last_shuttle, &delta );
 
         if (delta.tv_sec >= 1 || delta.tv_usec >= 5000) {
-            shuttle(0);
-            need_synthetic_shuttle = 0;
+            shuttle(dev, 0);
+            dev->need_synthetic_shuttle = 0;
         }
     }
 
-    if (jogvalue != 0xffff) {
+    if (dev->jogvalue != 0xffff) {
         value = value & 0xff;
-        direction = ((value - jogvalue) & 0x80) ? -1 : 1;
-        while (jogvalue != value) {
+        direction = ((value - dev->jogvalue) & 0x80) ? -1 : 1;
+        while (dev->jogvalue != value) {
             // driver fails to send an event when jogvalue == 0
-            jogvalue = (jogvalue + direction) & 0xff;
+            dev->jogvalue = (dev->jogvalue + direction) & 0xff;
         }
     }
-    jogvalue = value;
+    dev->jogvalue = value;
 }
 
 // Handler for jog and shuttle events, which calls the appropriate
 // function for each.
-void jogshuttle(unsigned short code, unsigned int value)
+void jogshuttle(DEVICE_STATE *dev, unsigned short code, unsigned int value)
 {
     switch (code) {
         case EVENT_CODE_JOG:
-            jog(value);
+            jog(dev, value);
             break;
         case EVENT_CODE_SHUTTLE:
-            shuttle(value);
+            shuttle(dev, value);
             break;
         default:
-            fprintf(stderr, "jogshuttle(%d, %d) invalid code\n", code, value);
+            LOG_WARN( "jogshuttle(%d, %d) invalid code", code, value );
             break;
     }
 }
 
 
 // Toplevel event handler
-void handle_event(EV ev)
+void handle_event(DEVICE_STATE *dev, EV ev)
 {
+    // commands queued while handling it are timed from the event
+    dev->event_us = stats_timeval_us( &ev.time );
+    dev->cmd_queue.event_us = dev->event_us;
     switch (ev.type) {
         case EVENT_TYPE_DONE:
         case EVENT_TYPE_ACTIVE_KEY:
             break;
         case EVENT_TYPE_KEY:
-            key(ev.code, ev.value);
+            stats_count( STATS_EVENTS_KEY, 1 );
+            key(dev, ev.code, ev.value);
             break;
         case EVENT_TYPE_JOGSHUTTLE:
-            jogshuttle(ev.code, ev.value);
+            stats_count( ev.code == EVENT_CODE_SHUTTLE ? STATS_EVENTS_SHUTTLE : STATS_EVENTS_JOG, 1 );
+            jogshuttle(dev, ev.code, ev.value);
             break;
         default:
-            fprintf(stderr, "handle_event() invalid type code\n");
+            LOG_WARN( "handle_event() invalid type code" );
             break;
     }
+    dev->cmd_queue.event_us = 0;
 }
 
-// A helper procedure to reset the program and cause the connection
-// to the websocket and to the shuttle device to be re-initialized.
-void reset_connections() {
-    fprintf(stderr, "============ Reinitializing connections\n");
-    cmd_queue.clear( &cmd_queue );
-    continuously_send_last_command = 0;
-    shuttle_device_connected = 0;
-    cnc_connected = 0;
-#if GPIO_SUPPORT
-    update_led_states( &led_states, shuttle_device_connected, cnc_connected, active_axis, active_speed );
-    drive_leds( &led_states );
-#endif
+
+// Handle the events of one SYN_REPORT frame.  The ShuttleXpress
+// reports the dial and the wheel together, and only the last shuttle
+// position of a frame matters, so earlier ones are skipped.
+void handle_frame( DEVICE_STATE *dev ) {
+    int i, last_shuttle = -1;
+
+    for (i = 0; i < dev->frame_len; i++) {
+        if (dev->frame[i].type == EVENT_TYPE_JOGSHUTTLE && dev->frame[i].code == EVENT_CODE_SHUTTLE) {
+            last_shuttle = i;
+        }
+    }
+    for (i = 0; i < dev->frame_len; i++) {
+        if (dev->frame[i].type == EVENT_TYPE_JOGSHUTTLE && dev->frame[i].code == EVENT_CODE_SHUTTLE &&
+            i != last_shuttle) {
+            continue;
+        }
+        handle_event( dev, dev->frame[i] );
+    }
+    dev->frame_len = 0;
 }
 
 
-int
-main(int argc, char **argv)
-{
-    EV ev;
-    int nread;
-    char *dev_name;
-    int fd, num_cmds_in_queue, num_cmds_sent;
-    struct timeval time_start;
-    struct timeval time_end;
-    struct timeval time_taken;
-    struct timeval time_to_sleep;
-    struct timeval cycle_time_us;
-    struct timeval select_timeout;
-    unsigned int sleep_us;
-    fd_set set;
-    char host[256];
-    char port[16];
-
-    select_timeout.tv_sec = 0;
-    select_timeout.tv_usec = 0;
-
-    cycle_time_us.tv_sec = 0;
-    cycle_time_us.tv_usec = CYCLE_TIME_MICROSECONDS;
-
-    if (argc != 2) {
-        fprintf(stderr, "usage: shuttlecp <device>\n" );
-        exit(1);
+// Collect an event from the jog controller into its frame, and handle
+// the frame once the SYN_REPORT closing it arrives.  If the kernel ran
+// out of room and dropped events, what is left of the frame is thrown
+// away.  The dial position is then unknown, so the next click only sets
+// it, and the shuttle is stopped rather than left running on a value
+// that may be stale.
+void device_input( DEVICE_STATE *dev, EV ev ) {
+    if (ev.type == EV_SYN && ev.code == SYN_DROPPED) {
+        LOG_WARN( "%s: kernel dropped input events", dev->path );
+        stats_count( STATS_EVENTS_DROPPED, 1 );
+        dev->frame_dropped = 1;
+        dev->frame_len = 0;
+        return;
     }
+    if (ev.type == EV_SYN && ev.code == SYN_REPORT) {
+        if (dev->frame_dropped) {
+            dev->frame_dropped = 0;
+            dev->jogvalue = 0xffff;
+            if (dev->continuously_send_last_command) {
+                shuttle( dev, 0 );
+            }
+            return;
+        }
+        dev->frame[dev->frame_len++] = ev;
+        handle_frame( dev );
+        return;
+    }
+    if (dev->frame_dropped)
+        return;
+    if (dev->frame_len == DEVICE_FRAME_EVENTS - 1) {
+        handle_frame( dev );    // keep the last slot for the SYN_REPORT
+    }
+    dev->frame[dev->frame_len++] = ev;
+}
 
-    dev_name = argv[1];
 
-    // initialize LEDs and switches
+// Replays have no device of their own, they drive the first one
+void replay_event( EV ev ) {
+    device_input( &devices[0], ev );
+}
+
+
+// Forget how the device was being used, e.g. when it was unplugged
+void reset_device( DEVICE_STATE *dev ) {
+    dev->stop_pending = 0;
+    dev->frame_len = 0;
+    dev->frame_dropped = 0;
+    clear_cmd_queue( dev );
+    dev->broadcast_axis  = -1;     // a new SPJS may have new clients
+    dev->broadcast_speed = -1;
+    discard_jog( dev );
+    dev->continuously_send_last_command = 0;
+    set_resend_timer( dev, 0 );
+    planner_init( &dev->planner );
+}
+
+
+// Show the state on the LEDs, to the publish subscribers and in the
+// metrics' gauges.  The LEDs
+// follow the first device, and only show the shuttle as connected when
+// all of them are; the subscribers hear about every device.
+void show_state() {
+    PUBLISH_STATE state;
+    DEVICE_STATE *dev;
+    int i, queued = 0, num_open = 0;
 #if GPIO_SUPPORT
-    wiringPiSetup(); 
-    initialize_led_states( &led_states );
-    initialize_raspi_switch_states( &raspi_switches );
+    int all_connected = 1;
+
+    for (i = 0; i < num_devices; i++) {
+        all_connected = all_connected && devices[i].connected;
+    }
+    update_led_states( &led_states, all_connected, cnc_connected,
+                       devices[0].active_axis, devices[0].active_speed );
     drive_leds( &led_states );
 #endif
 
-    cmd_queue = createQueue();
-    fd = -1;
-    shuttle_device_connected = 0;
+    for (i = 0; i < num_devices; i++) {
+        queued += devices[i].cmd_queue.size;
+        num_open += devices[i].connected;
+    }
+    stats_gauge( STATS_QUEUE_DEPTH, queued );
+    stats_gauge( STATS_CNC_CONNECTED, cnc_connected );
+    stats_gauge( STATS_DEVICES_CONNECTED, num_open );
+
+    state.cnc_connected = cnc_connected;
+    state.num_devices   = num_devices < PUBLISH_MAX_DEVICES ? num_devices : PUBLISH_MAX_DEVICES;
+    for (i = 0; i < state.num_devices; i++) {
+        dev = &devices[i];
+        state.devices[i].connected = dev->connected;
+        state.devices[i].axis      = axis_letters[dev->active_axis];
+        state.devices[i].speed     = dev->active_speed + 1;
+        state.devices[i].increment = config.increments[dev->active_speed];
+    }
+    publish_state( &state );
+}
+
+// Try again to reach SPJS (or bCNC) after delay_us
+void schedule_cnc_connect( long delay_us ) {
+    cnc_retry_pending = 1;
+    // a zero delay would disarm the timer
+    timer_once( cnc_retry_timer_fd, delay_us > 0 ? delay_us : 1 );
+}
+
+
+// The transport is up
+void cnc_connect_done() {
+    int i;
+
+    cnc_connecting = 0;
+    cnc_connected  = 1;
+    cnc_retry_us   = CNC_RETRY_MIN_MICROSECONDS;
+    timer_once( cnc_retry_timer_fd, 0 );
+    LOG_INFO( "%s connected.", transport->name );
+
+    // a controller that was reset or re-opened has forgotten what we
+    // told it last time, so tell it again
+    if (controller->connect_lines && transport->controller_setup) {
+        for (i = 0; i < num_devices; i++) {
+            devices[i].cmd_queue.push( &devices[i].cmd_queue, CMD_GCODE, controller->connect_lines );
+        }
+    }
+}
+
+
+// This attempt didn't work out, back off before the next one
+void cnc_connect_failed() {
+    stats_count( STATS_CONNECT_FAILURES, 1 );
+    transport->close();
+    cnc_connecting = 0;
+    LOG_INFO( "No connection to %s:%s, retrying in %ld ms", config.host, config.port, cnc_retry_us / 1000 );
+    schedule_cnc_connect( cnc_retry_us );
+    cnc_retry_us *= 2;
+    if (cnc_retry_us > CNC_RETRY_MAX_MICROSECONDS) {
+        cnc_retry_us = CNC_RETRY_MAX_MICROSECONDS;
+    }
+}
+
+
+// A helper procedure to reset the program and cause the connection
+// to SPJS (or the controller) to be re-initialized.  The jog controllers
+// stay open, but anything they had in flight is forgotten, since the
+// machine never saw it.
+void reset_connections() {
+    int i;
+
+    LOG_INFO( "============ Reinitializing connections" );
+    stats_count( STATS_RECONNECTS, 1 );
+    for (i = 0; i < num_devices; i++) {
+        reset_device( &devices[i] );
+    }
+    cnc_connected  = 0;
+    cnc_connecting = 0;
+    reconnect_requested = 0;
+    transport->close();
+    schedule_cnc_connect( cnc_retry_us );
+    show_state();
+}
+
+
+// Stop reading a jog controller
+void close_device( DEVICE_STATE *dev ) {
+    if (dev->fd >= 0) {
+        event_loop_remove( device_loop, dev->fd );
+        close( dev->fd );
+        dev->fd = -1;
+    }
+}
 
+
+// A jog controller has gone away.  Stop anything it was doing, but
+// leave the connection to SPJS and the other controllers alone.
+void device_disconnected( DEVICE_STATE *dev ) {
+    LOG_INFO( "Lost jog controller %s", dev->path );
+    dev->connected = 0;
+    reset_device( dev );
+    show_state();
+}
+
+
+// Reading the jog controller failed.  Close it and keep looking for
+// it to come back.  In threaded mode the input thread owns the device
+// and tells the main thread, which handles it the same way as the
+// single threaded loop does.
+void shuttle_device_lost( DEVICE_STATE *dev ) {
+    INPUT_MSG msg;
+
+    close_device( dev );
+    timer_set( device_retry_timer_fd, DEVICE_RETRY_MICROSECONDS );
+    if (THREADED_INPUT) {
+        msg.type = INPUT_DEVICE_LOST;
+        msg.device = dev->index;
+        while (input_queue_push( &input_queue, &msg )) {
+            usleep(1000);
+        }
+    } else {
+        device_disconnected( dev );
+    }
+}
+
+
+// Event loop handler for the jog controller.  The device is opened
+// non-blocking, so read every event that is waiting, as many at a time
+// as will fit, and then return.  In threaded mode the events are only
+// passed on to the main thread.
+void shuttle_device_event( int fd, unsigned int events, void *data ) {
+    DEVICE_STATE *dev = data;
+    EV evs[DEVICE_READ_EVENTS];
+    INPUT_MSG msg;
+    int i, nread;
+
+    (void)events;
     while (1) {
+        nread = read(fd, evs, sizeof(evs));
+        if (nread > 0 && nread % sizeof(EV) == 0) {
+            for (i = 0; i < nread / (int)sizeof(EV); i++) {
+                if (dev->index == 0) {
+                    record_event( &evs[i] );    // a recording has room for one device
+                }
+                if (THREADED_INPUT) {
+                    msg.type = INPUT_EVENT;
+                    msg.device = dev->index;
+                    msg.ev = evs[i];
+                    // if the main thread is that far behind, hold off
+                    // reading and let the kernel buffer events instead
+                    while (input_queue_push( &input_queue, &msg )) {
+                        usleep(1000);
+                    }
+                } else {
+                    device_input( dev, evs[i] );
+                }
+            }
+            if (nread < (int)sizeof(evs))
+                break;                          // that was all of them
+        } else {
+            if (nread < 0) {
+                if (errno == EAGAIN || errno == EINTR)
+                    break;
+                LOG_ERRNO( "read event" );
+            } else {
+                LOG_ERROR( "short read: %d", nread );
+            }
+            shuttle_device_lost( dev );
+            break;
+        }
+    }
+}
+
+
+// The device whose serial port an SPJS message is about, from its
+// "P" field.  NULL if it is about none of ours, even with only one
+// device: SPJS may have other ports open, and their oks and queue
+// counts must not be taken for our controller's.
+DEVICE_STATE *device_for_reply( const char *msg, int len ) {
+    const char *end = msg + len;
+    const char *p;
+    int i, n;
 
-        // Skip initialisation of websocket if bCNC is being used
-        if (!BCNC) {
-            // initialize - open websocket and open device
-            snprintf(host, sizeof(host), CNC_HOST);
-            snprintf(port, sizeof(port), CNC_PORT);
-            fprintf(stderr, "Attempting connection to %s:%s\n", host, port);
-            while ( websocket_init( host, port ) ) {
-                fprintf(stderr, "Attempting connection to %s:%s\n", host, port);
-                usleep(1000000);
+    for (p = msg; p + 5 <= end; p++) {
+        // serial data and "Write"/"Complete" say "P", "Queued" says "Port"
+        if (memcmp( p, "\"P\":\"", 5 ) == 0 ||
+            (p + 8 <= end && memcmp( p, "\"Port\":\"", 8 ) == 0)) {
+            p += (p[2] == '"') ? 5 : 8;
+            for (i = 0; i < num_devices; i++) {
+                n = strlen( devices[i].serial );
+                if (p + n < end && memcmp( p, devices[i].serial, n ) == 0 && p[n] == '"')
+                    return &devices[i];
             }
-            cnc_connected = 1;
-            reconnect_requested = 0;
-            fprintf(stderr, "Websocket connected.\n");
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+
+// Each message from SPJS may tell us a controller took a line, how
+// full its planner is, or how much SPJS still has queued for it.
+void websocket_reply( const char *msg, int len ) {
+    DEVICE_STATE *dev = device_for_reply( msg, len );
+    struct timespec now;
+
+    if (dev) {
+        planner_parse_reply( &dev->planner, msg, len );
+        if (dev->stop_pending && !dev->continuously_send_last_command &&
+            stop_can_repeat( dev )) {
+            dev->stop_pending = 0;
+            clock_gettime( CLOCK_MONOTONIC, &now );
+            send_realtime( dev, controller->stop_realtime, &now );
         }
-        else {
-            cnc_connected = 1;
-            reconnect_requested = 0;
-            fprintf(stderr, "HTTP used for bCNC.\n");            
+    }
+}
+
+
+// A line the controller printed, straight from its serial port
+void controller_line( int port, const char *line, int len ) {
+    planner_parse_line( &devices[port].planner, line, len, 0 );
+}
+
+
+// The transport couldn't connect, or has lost the connection
+void cnc_lost() {
+    if (cnc_connecting) {
+        cnc_connect_failed();
+    } else {
+        cnc_connected = 0;
+    }
+}
+
+
+// Everything the transport had read has been handled
+void cnc_replies_done() {
+    int i;
+
+    // an acknowledgement may have made room for another segment
+    if (stream_pacing()) {
+        for (i = 0; i < num_devices; i++) {
+            if (devices[i].continuously_send_last_command) {
+                stream_shuttle_segments( &devices[i] );
+            }
         }
+    }
+}
+
+
+const TRANSPORT_HANDLERS cnc_handlers = {
+    cnc_connect_done, cnc_lost, websocket_reply, controller_line, cnc_replies_done,
+};
+
+
+// Event loop handler for the jog coalescing window.  If more clicks
+// came in, send them and keep the window open for the next lot.
+void jog_timer_event( int fd, unsigned int events, void *data ) {
+    DEVICE_STATE *dev = data;
+
+    (void)events;
+    timer_ack( fd );
+    if (dev->jog_clicks) {
+        flush_jog( dev );
+        timer_once( dev->jog_timer_fd, JOG_COALESCE_MICROSECONDS );
+    } else {
+        dev->jog_window_open = 0;
+    }
+}
+
+
+// Event loop handler for messages from the input thread
+void input_queue_event( int fd, unsigned int events, void *data ) {
+    DEVICE_STATE *dev;
+    INPUT_MSG msg;
+
+    (void)fd;
+    (void)events;
+    (void)data;
+    input_queue_ack( &input_queue );
+    while (input_queue_pop( &input_queue, &msg ) == 0) {
+        dev = &devices[msg.device];
+        switch (msg.type) {
+            case INPUT_EVENT:
+                device_input( dev, msg.ev );
+                break;
+            case INPUT_SWITCHES:
 #if GPIO_SUPPORT
-        update_led_states( &led_states, shuttle_device_connected, cnc_connected, active_axis, active_speed );
-        drive_leds( &led_states );
+                process_raspi_switches( &msg.switches );
 #endif
+                break;
+            case INPUT_DEVICE_CONNECTED:
+                dev->connected = 1;
+                break;
+            case INPUT_DEVICE_LOST:
+                device_disconnected( dev );
+                break;
+            case INPUT_WAKEUP_LATE:
+                stats_record( STATS_WAKEUP_LATE, msg.late_us );
+                break;
+        }
+    }
+}
 
-        // Open the connection to the device - loop until
-        // we connect.
-        while (!shuttle_device_connected) {
-            fd = open(dev_name, O_RDONLY);
-            if (fd < 0) {
-                perror(dev_name);
-                sleep(1);
-                continue;
-            }
 
-            // Flag it as exclusive access
-            if(ioctl( fd, EVIOCGRAB, 1 ) < 0) {
-                perror( "evgrab ioctl" );
-                sleep(1);
-                continue;
-            }
+// Event loop handler for the resend timer: while the shuttle wheel is
+// held, queue up another copy of the last shuttle command, or in
+// streaming mode top up the look-ahead as queued motion runs out.
+void resend_timer_event( int fd, unsigned int events, void *data ) {
+    DEVICE_STATE *dev = data;
+    unsigned long long expirations;
 
-            // if we get to here, we're connected
-            shuttle_device_connected = 1;
-            fprintf(stderr, "Shuttle device connected.\n");
+    (void)events;
+    expirations = timer_ack( fd );
+    if (expirations > 1) {
+        // the loop was busy elsewhere for whole cycles
+        stats_count( STATS_CYCLE_OVERRUNS, expirations - 1 );
+    }
+    if ( dev->continuously_send_last_command && cnc_connected ) {
+        if (stream_pacing()) {
+            stream_shuttle_segments( dev );
+        } else if (queued_last( &dev->cmd_queue, dev->lastcmd )) {
+            // the last copy hasn't gone out yet, one more would only
+            // add to what is queued ahead of the machine
+            LOG_TRACE( "Shuttle command still queued, skipping resend" );
+        } else if (planner_spjs_queued( &dev->planner, SPJS_REPORT_TIMEOUT_US ) <= SPJS_MAX_QUEUED) {
+            dev->cmd_queue.push( &dev->cmd_queue, CMD_GCODE, dev->lastcmd );
+        } else {
+            // SPJS is behind; piling more on would only make the
+            // machine coast further once the shuttle is released
+            LOG_TRACE( "SPJS has %d lines queued, skipping resend", dev->planner.spjs_queued );
         }
+    }
+}
 
-        // The main loop we operate in
-        while (1) {
 
-            // if we have lost connection to the websocket, or if we have
-            // a request to reconnect everything, then break
-            // the loop so we can reinitialize everything.
-            if (!cnc_connected || reconnect_requested) {
-                reset_connections();
-                break;
-            }
+// Event loop handler for SIGUSR1: print the latency histograms
+void stats_signal_event( int fd, unsigned int events, void *data ) {
+    struct signalfd_siginfo info;
 
-            gettimeofday( &time_start, 0 );
+    (void)events;
+    (void)data;
+    while (read( fd, &info, sizeof(info) ) == sizeof(info)) {
+        log_flush();
+        stats_dump( stderr );
+    }
+}
 
-            // We are going to just select on the FD to see if a read
-            // would produce any data.  If not, we skip the read.
-            FD_ZERO(&set);
-            FD_SET(fd, &set);
 
-            while (select(fd+1, &set, NULL, NULL, &select_timeout)) {
-                // read jog controller events
-                nread = read(fd, &ev, sizeof(ev));
-                if (nread == sizeof(ev)) {
-                    handle_event(ev);
-                } else {
-                    if (nread < 0) {
-                        perror("read event");
-                        reconnect_requested = 1;
-                        shuttle_device_connected = 0;
-                        break;
-                    } else {
-                        fprintf(stderr, "short read: %d\n", nread);
-                        reconnect_requested = 1;
-                        shuttle_device_connected = 0;
-                        break;
-                    }
-                }
+// Try to open the jog controller.  Returns the fd, or -1 if it isn't
+// there (yet).  A failure is only logged the first time round.
+int open_shuttle_device( DEVICE_STATE *dev ) {
+    int fd;
+    int clock_id = CLOCK_MONOTONIC;
+
+    fd = open(dev->path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        if (!dev->open_failed) {
+            LOG_ERRNO( dev->path );
+        }
+        dev->open_failed = 1;
+        return -1;
+    }
+
+    // Flag it as exclusive access
+    if(ioctl( fd, EVIOCGRAB, 1 ) < 0) {
+        if (!dev->open_failed) {
+            LOG_ERRNO( "evgrab ioctl" );
+        }
+        dev->open_failed = 1;
+        close(fd);
+        return -1;
+    }
+
+    // Stamp events with the clock stats_now_us() reads, so the
+    // latency from the click can be measured.  Not fatal if the
+    // kernel is too old for it, the numbers are just meaningless.
+    if (ioctl( fd, EVIOCSCLOCKID, &clock_id ) < 0) {
+        LOG_WARN( "EVIOCSCLOCKID ioctl: %s", strerror( errno ) );
+    }
+
+    // if we get to here, we're connected
+    dev->open_failed = 0;
+    LOG_INFO( "Shuttle device connected: %s", dev->path );
+    return fd;
+}
+
+
+// Set up devices[num_devices] from a <device>[=<serial port>] argument
+int add_device( char *arg ) {
+    DEVICE_STATE *dev = &devices[num_devices];
+    char *sep = strchr( arg, '=' );
+
+    if (num_devices == MAX_DEVICES) {
+        LOG_ERROR( "Too many devices, at most %d are supported", MAX_DEVICES );
+        return 1;
+    }
+    memset( dev, 0, sizeof(*dev) );
+    dev->path   = arg;
+    dev->serial = config.device_path;
+    if (sep) {
+        *sep = '\0';
+        dev->serial = sep + 1;
+    }
+    dev->index        = num_devices;
+    dev->fd           = -1;
+    dev->jogvalue     = 0xffff;
+    dev->shuttlevalue = 0xffff;
+    dev->active_axis  = X_AXIS_ACTIVE;
+    dev->active_speed = MOTION_SPEED_4;
+    dev->broadcast_axis  = -1;
+    dev->broadcast_speed = -1;
+    // Rather lose the newest command than have the ones already
+    // queued go out with a gap in the middle of them.
+    dev->cmd_queue = createQueue( QUEUE_REJECT );
+    planner_init( &dev->planner );
+    if (transport->add_port( dev->index, dev->serial )) {
+        return 1;
+    }
+    num_devices++;
+    return 0;
+}
+
+
+// Give each device its timers, once the event loop is up
+int start_device_timers() {
+    DEVICE_STATE *dev;
+    int i;
+
+    for (i = 0; i < num_devices; i++) {
+        dev = &devices[i];
+        dev->resend_timer_fd = timer_new();
+        if (dev->resend_timer_fd < 0 ||
+            event_loop_add( &event_loop, dev->resend_timer_fd, EPOLLIN, resend_timer_event, dev )) {
+            return 1;
+        }
+        dev->jog_timer_fd = timer_new();
+        if (dev->jog_timer_fd < 0 ||
+            event_loop_add( &event_loop, dev->jog_timer_fd, EPOLLIN, jog_timer_event, dev )) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// Open every device that isn't open yet and start reading it.  While
+// any are missing, the retry timer keeps trying.
+void open_devices() {
+    DEVICE_STATE *dev;
+    INPUT_MSG msg;
+    int i, missing = 0;
+
+    for (i = 0; i < num_devices; i++) {
+        dev = &devices[i];
+        if (dev->fd >= 0)
+            continue;
+        dev->fd = open_shuttle_device( dev );
+        if (dev->fd < 0) {
+            missing = 1;
+            continue;
+        }
+        if (event_loop_add( device_loop, dev->fd, EPOLLIN, shuttle_device_event, dev )) {
+            exit(1);
+        }
+        if (THREADED_INPUT) {
+            msg.type   = INPUT_DEVICE_CONNECTED;
+            msg.device = i;
+            while (input_queue_push( &input_queue, &msg )) {
+                usleep(1000);
             }
+        } else {
+            dev->connected = 1;
+        }
+    }
+    timer_set( device_retry_timer_fd, missing ? DEVICE_RETRY_MICROSECONDS : 0 );
+}
+
+
+// Event loop handler for the device retry timer
+void device_retry_event( int fd, unsigned int events, void *data ) {
+    (void)events;
+    (void)data;
+    timer_ack( fd );
+    open_devices();
+}
+
+
+// udev has set up a new input device, which may be one of ours
+void device_added( const char *devnode ) {
+    (void)devnode;      // ours are often named by a udev link, just try them all
+    open_devices();
+}
+
+
+// Start reading the jog controllers in loop, and opening them again
+// whenever they come back
+int start_devices( EVENT_LOOP *loop ) {
+    device_loop = loop;
+    device_retry_timer_fd = timer_new();
+    if (device_retry_timer_fd < 0 ||
+        event_loop_add( loop, device_retry_timer_fd, EPOLLIN, device_retry_event, NULL ) ||
+        hotplug_init( loop, device_added )) {
+        return 1;
+    }
+    open_devices();
+    return 0;
+}
+
+
+// Connect to SPJS or the controller, or just note that bCNC is used.
+// This only starts the websocket handshake (or waits for the controller
+// to answer), the transport sees it through, so jog input keeps being
+// handled while that takes its time.
+void connect_cnc() {
+    int ready;
+
+    cnc_retry_pending = 0;
+    ready = transport->connect();
+    if (ready < 0) {
+        cnc_connect_failed();
+    } else if (ready > 0) {
+        cnc_connect_done();
+    } else {
+        cnc_connecting = 1;
+        timer_once( cnc_retry_timer_fd, CNC_CONNECT_TIMEOUT_MICROSECONDS );
+    }
+}
+
+
+// Event loop handler for the reconnect timer, which also times out a
+// handshake that is taking too long
+void cnc_retry_event( int fd, unsigned int events, void *data ) {
+    (void)events;
+    (void)data;
+    timer_ack( fd );
+    if (cnc_connecting) {
+        LOG_WARN( "Timed out connecting to %s", transport->name );
+        cnc_connect_failed();
+    } else {
+        connect_cnc();
+    }
+}
+
+
+// send all queued commands
+void send_queued_cmds() {
+    int lines, num_cmds_sent;
+    DEVICE_STATE *dev;
+    int i;
+
+    // While earlier output (a websocket frame, a bCNC request) is still
+    // going out, new commands wait in the queue, so that they all go
+    // out batched together once it is done.  The devices take turns at
+    // going first, so none of them can starve the others.
+    for (i = 0; i < num_devices && cnc_connected && !transport->busy(); i++) {
+        dev = &devices[(next_device + i) % num_devices];
+        if (dev->cmd_queue.size == 0)
+            continue;
+        lines = stream_pacing() ? queued_device_lines( &dev->cmd_queue ) : 0;
+        num_cmds_sent = transport->send( dev->index, &dev->cmd_queue );
+        if (num_cmds_sent < 0) {
+            // whatever is still queued is dropped while we reconnect
+            stats_count( STATS_CMDS_FAILED, dev->cmd_queue.size );
+            cnc_connected = 0;
+            return;
+        }
+        if (stream_pacing()) {
+            planner_lines_sent( &dev->planner, lines - queued_device_lines( &dev->cmd_queue ) );
+        }
+        next_device = (dev->index + 1) % num_devices;
+    }
+}
+
+
+// While there is no connection, moves are thrown away rather than
+// saved up: a late move is worse than none.
+void drop_queued_cmds() {
+    int i;
+
+    for (i = 0; i < num_devices; i++) {
+        clear_cmd_queue( &devices[i] );
+        discard_jog( &devices[i] );
+    }
+}
+
+
+// True when everything queued so far has gone out, so a flat out
+// replay can feed in the next event.
+int pipeline_idle() {
+    int i;
+
+    for (i = 0; i < num_devices; i++) {
+        if (devices[i].cmd_queue.size > 0 || devices[i].jog_window_open)
+            return 0;
+    }
+    return !transport->busy();
+}
+
+
+// What a replay achieved, printed when it has finished
+void replay_report( long long start_us, unsigned long start_allocations ) {
+    const STATS_HISTOGRAM *sent = stats_histogram( STATS_QUEUE_TO_WIRE );
+    double elapsed = (stats_now_us() - start_us) / 1e6;
 
-            // read raspberry pi buttons/switches
+    log_flush();
+    printf("replayed %d events in %.3f s\n", replay_count(), elapsed);
+    printf("%lu commands sent, %.0f commands/s\n", sent->count, sent->count / elapsed);
+    if (bench_allocations) {
+        printf("%lu heap allocations on the main thread, %.2f per command\n",
+               bench_allocations() - start_allocations,
+               sent->count ? (double)(bench_allocations() - start_allocations) / sent->count : 0.0);
+    }
+    stats_dump( stdout );
+}
+
+
+void usage() {
+    fprintf(stderr,
+        "usage: shuttlecp [options] <device>[=<serial port>] ...\n"
+        "       shuttlecp [options] --replay <file> | --synthetic <rounds>\n"
+        "  up to %d jog controllers, each driving the machine on its own serial port\n"
+        "  (--serial if none is given)\n"
+        "  -r, --record <file>      save the events read from the first <device> to <file>\n"
+        "  -R, --replay <file>      feed a recording through instead of reading a device\n"
+        "  -S, --synthetic <rounds> feed a made up stream of jogs and shuttles through\n"
+        "  -x, --speed <factor>     replay speed, 1 is real time, 0 as fast as it will go\n"
+        "  -m, --mock               send to a mock SPJS or bCNC on port " MOCK_PORT " instead\n"
+        "  -c, --config <file>      read settings from <file> (default " CONFIG_DEFAULT_PATH ")\n"
+        "  -H, --host <host>        host SPJS or bCNC is running on\n"
+        "  -P, --port <port>        port SPJS or bCNC is listening on\n"
+        "  -d, --serial <path>      serial port the controller is on\n"
+        "      --tinyg              the controller is a TinyG\n"
+        "      --bcnc               send to bCNC instead of SPJS\n"
+        "      --direct             talk to the controller on its serial port, without SPJS\n"
+        "      --grbl-jog           shuttle with GRBL 1.1 $J= jogs and jog cancel\n"
+        "      --jog-accel          move further per click the faster the dial turns\n"
+        "      --publish <path>     publish axis, speed and connections on a Unix socket\n"
+        "      --metrics <port>     serve Prometheus metrics over HTTP on <port>\n"
+        "      --realtime <prio>    read the jog controller at SCHED_FIFO <prio>, memory locked\n"
+        "      --cpu <n>            and only on CPU <n>\n"
+        "      --jitter             measure how late reading the jog controller wakes up\n"
+        "  -l, --log-level <level>  error, warn, info, debug or trace\n", MAX_DEVICES);
+}
+
+
+// A jitter probe sample.  The stats belong to the main thread, so from
+// the input thread it is passed on like everything else; if the queue
+// is full the sample is dropped rather than holding up the input.
+void record_wakeup_late( long long late_us ) {
+    INPUT_MSG msg;
+
+    if (THREADED_INPUT && !replaying) {
+        msg.type    = INPUT_WAKEUP_LATE;
+        msg.device  = 0;
+        msg.late_us = late_us;
+        input_queue_push( &input_queue, &msg );
+    } else {
+        stats_record( STATS_WAKEUP_LATE, late_us );
+    }
+}
+
+
+// Real-time mode (if asked for) and the jitter probe, for whichever
+// thread reads the jog controller, running loop.  Anything asked for
+// that can't be had is fatal, rather than running without it unnoticed.
+void start_input_realtime( EVENT_LOOP *loop ) {
+    if (config.realtime_priority > 0 || config.cpu >= 0) {
+        if (realtime_thread( config.realtime_priority, config.cpu )) {
+            exit(1);
+        }
+    }
+    if (jitter_probe && jitter_probe_start( loop, record_wakeup_late )) {
+        exit(1);
+    }
+}
+
+
+// Threaded mode: this thread only reads the jog controller and the
+// switches and hands what it sees to the main thread, so input is never
+// held up by whatever the main thread is doing with the transport.
+void *input_thread( void *arg ) {
 #if GPIO_SUPPORT
-            read_raspi_switches( &raspi_switches );
-            process_raspi_switches( &raspi_switches );
+    int fd;
 #endif
 
-            // send all queued commands
-            if (cnc_connected) {
+    (void)arg;
+    if (event_loop_init( &input_loop )) {
+        exit(1);
+    }
+    start_input_realtime( &input_loop );
+#if GPIO_SUPPORT
+    fd = enable_raspi_switch_interrupts();
+    if (fd < 0 || event_loop_add( &input_loop, fd, EPOLLIN, switch_event, NULL )) {
+        exit(1);
+    }
+#endif
 
-                if (!BCNC) {
-                    num_cmds_in_queue = cmd_queue.size;
-                    num_cmds_sent = websocket_send_cmds( &cmd_queue );
-                    if (num_cmds_sent != num_cmds_in_queue) {
-                        cnc_connected = 0;
-                    }
-                } else {
-                    http_send_cmds( &cmd_queue);
-                }
+    if (start_devices( &input_loop )) {
+        exit(1);
+    }
+    while (1) {
+        if (event_loop_run_once( &input_loop, -1 ) < 0) {
+            LOG_ERROR( "Input thread event loop failed" );
+            exit(1);
+        }
+    }
+    return NULL;
+}
 
-                // If we should be continuously sending a cmd, enqueue it here
-                if ( continuously_send_last_command && cnc_connected ) {
-                    cmd_queue.push( &cmd_queue, lastcmd );
-                }
-            }
 
+int
+main(int argc, char **argv)
+{
+    static const struct option options[] = {
+        { "record",    required_argument, NULL, 'r' },
+        { "replay",    required_argument, NULL, 'R' },
+        { "synthetic", required_argument, NULL, 'S' },
+        { "speed",     required_argument, NULL, 'x' },
+        { "mock",      no_argument,       NULL, 'm' },
+        { "config",    required_argument, NULL, 'c' },
+        { "host",      required_argument, NULL, 'H' },
+        { "port",      required_argument, NULL, 'P' },
+        { "serial",    required_argument, NULL, 'd' },
+        { "tinyg",     no_argument,       NULL, 'T' },
+        { "bcnc",      no_argument,       NULL, 'B' },
+        { "direct",    no_argument,       NULL, 'D' },
+        { "grbl-jog",  no_argument,       NULL, 'G' },
+        { "jog-accel", no_argument,       NULL, 'J' },
+        { "publish",   required_argument, NULL, 'U' },
+        { "metrics",   required_argument, NULL, 'M' },
+        { "realtime",  required_argument, NULL, 'Q' },
+        { "cpu",       required_argument, NULL, 'C' },
+        { "jitter",    no_argument,       NULL, 'W' },
+        { "log-level", required_argument, NULL, 'l' },
+        { NULL,        0,                 NULL, 0   },
+    };
+    static const char short_options[] = "r:R:S:x:mc:H:P:d:l:";
+    static char replay_device[] = "replay";
+    const char *record_path = NULL, *replay_path = NULL, *config_path = NULL;
+    int fd, opt, err = 0, synthetic_rounds = 0, mock = 0, replay_started = 0;
+    double replay_speed = 1.0;
+    long long replay_start_us = 0, pass_start_us, pass_us;
+    unsigned long replay_start_allocations = 0;
+    pthread_t input_tid;
+    sigset_t signals;
+
+    log_init();
+
+    // The config file first, so the rest of the command line overrides it
+    opterr = 0;
+    while ((opt = getopt_long( argc, argv, short_options, options, NULL )) != -1) {
+        if (opt == 'c') {
+            config_path = optarg;
+        }
+    }
+    if (config_load( &config, config_path ? config_path : CONFIG_DEFAULT_PATH, config_path != NULL )) {
+        exit(1);
+    }
+
+    opterr = 1;
+    optind = 0;
+    while ((opt = getopt_long( argc, argv, short_options, options, NULL )) != -1) {
+        switch (opt) {
+            case 'r': record_path = optarg;                 break;
+            case 'R': replay_path = optarg;                 break;
+            case 'S': synthetic_rounds = atoi( optarg );    break;
+            case 'x': replay_speed = atof( optarg );        break;
+            case 'm': mock = 1;                             break;
+            case 'c':                                       break;
+            case 'H': err = config_set( &config, "host", optarg );        break;
+            case 'P': err = config_set( &config, "port", optarg );        break;
+            case 'd': err = config_set( &config, "device_path", optarg ); break;
+            case 'T': config.tinyg = 1;                     break;
+            case 'B': config.bcnc  = 1;                     break;
+            case 'D': config.direct_serial = 1;             break;
+            case 'G': config.grbl_jog = 1;                  break;
+            case 'J': config.jog_accel = 1;                 break;
+            case 'U': err = config_set( &config, "publish_path", optarg ); break;
+            case 'M': err = config_set( &config, "metrics_port", optarg ); break;
+            case 'Q': err = config_set( &config, "realtime_priority", optarg ); break;
+            case 'C': err = config_set( &config, "cpu", optarg );          break;
+            case 'W': jitter_probe = 1;                     break;
+            case 'l': err = config_set( &config, "log_level", optarg );   break;
+            default:  usage(); exit(1);
+        }
+        if (err) {
+            LOG_ERROR( "Bad value for -%c: %s", opt, optarg );
+            log_flush();
+            usage();
+            exit(1);
+        }
+    }
+    if (config.log_level >= 0) {
+        log_level = config.log_level;
+    }
+    if (config.grbl_jog && (config.bcnc || config.tinyg)) {
+        // bCNC has no way to pass on the jog cancel, and TinyG has no $J=
+        LOG_WARN( "GRBL jogging needs SPJS and a GRBL 1.1, not using it" );
+        config.grbl_jog = 0;
+    }
+    if (config.bcnc && config.direct_serial) {
+        LOG_ERROR( "bCNC and the serial port can't both be used" );
+        log_flush();
+        exit(1);
+    }
+    if (mock && config.direct_serial) {
+        LOG_ERROR( "The mock server has no serial port" );
+        log_flush();
+        exit(1);
+    }
+    controller = config.tinyg ? &controller_tinyg : config.grbl_jog ? &controller_grbl_jog : &controller_grbl;
+    transport  = config.bcnc ? &transport_bcnc : config.direct_serial ? &transport_serial : &transport_spjs;
+    LOG_DEBUG( "Controller profile: %s, transport: %s", controller->name, transport->name );
+    transport_settings.host       = config.host;
+    transport_settings.port       = config.port;
+    transport_settings.batch_mode = BATCH_COMMANDS;
+    transport_settings.baud       = config.baud;
+    prepare_commands();
+    replaying = (replay_path != NULL || synthetic_rounds > 0);
+    if ((optind == argc) == !replaying) {
+        usage();
+        exit(1);
+    }
+    if (replaying && add_device( replay_device )) {
+        exit(1);
+    }
+    while (optind < argc) {
+        if (add_device( argv[optind++] )) {
+            exit(1);
+        }
+    }
+
+    if ((record_path && record_open( record_path )) ||
+        (replay_path && replay_load( replay_path )) ||
+        (!replay_path && synthetic_rounds > 0 && replay_synthetic( synthetic_rounds ))) {
+        exit(1);
+    }
+    if (mock) {
+        // before any threads are started
+        if (mock_start( MOCK_PORT, config.bcnc )) {
+            exit(1);
+        }
+        strcpy( config.host, MOCK_HOST );
+        strcpy( config.port, MOCK_PORT );
+    }
+
+    // SIGUSR1 dumps the latency stats.  Block it before any thread is
+    // started, so it is only ever picked up through the signalfd.
+    sigemptyset( &signals );
+    sigaddset( &signals, SIGUSR1 );
+    pthread_sigmask( SIG_BLOCK, &signals, NULL );
+
+    // initialize LEDs and switches
 #if GPIO_SUPPORT
-            // update LEDs
-            update_led_states( &led_states, shuttle_device_connected, cnc_connected, active_axis, active_speed );
-            drive_leds( &led_states );
+    wiringPiSetup(); 
+    initialize_led_states( &led_states );
+    initialize_raspi_switch_states( &raspi_switches );
+    drive_leds( &led_states );
 #endif
 
-            // sleep until next cycle
-            gettimeofday( &time_end, 0 );
-            timersub( &time_end, &time_start, &time_taken );
-            timersub( &cycle_time_us, &time_taken, &time_to_sleep );
-            if (time_to_sleep.tv_sec < 0) {
-                sleep_us = 0;
-            } else {
-                sleep_us = time_to_sleep.tv_usec;
-                usleep( sleep_us );
+    if (event_loop_init( &event_loop )) {
+        exit(1);
+    }
+    fd = signalfd( -1, &signals, SFD_NONBLOCK | SFD_CLOEXEC );
+    if (fd < 0 || event_loop_add( &event_loop, fd, EPOLLIN, stats_signal_event, NULL )) {
+        LOG_ERRNO( "signalfd" );
+        exit(1);
+    }
+#if GPIO_SUPPORT
+    if (!THREADED_INPUT) {
+        fd = enable_raspi_switch_interrupts();
+        if (fd < 0 || event_loop_add( &event_loop, fd, EPOLLIN, switch_event, NULL )) {
+            exit(1);
+        }
+    }
+#endif
+    if (start_device_timers()) {
+        exit(1);
+    }
+    cnc_retry_timer_fd = timer_new();
+    if (cnc_retry_timer_fd < 0 ||
+        event_loop_add( &event_loop, cnc_retry_timer_fd, EPOLLIN, cnc_retry_event, NULL )) {
+        exit(1);
+    }
+    if (transport->init( &event_loop, &transport_settings, &cnc_handlers )) {
+        exit(1);
+    }
+    if (config.publish_path[0] && publish_init( &event_loop, config.publish_path )) {
+        exit(1);
+    }
+    if (config.metrics_port[0] && metrics_init( &event_loop, config.metrics_port )) {
+        exit(1);
+    }
+
+    // before the input thread, so its stack is locked as well
+    if (config.realtime_priority > 0 && realtime_lock_memory()) {
+        exit(1);
+    }
+    if (replaying || !THREADED_INPUT) {
+        start_input_realtime( &event_loop );
+    }
+
+    if (replaying) {
+        devices[0].connected = 1;
+    } else if (THREADED_INPUT) {
+        if (input_queue_init( &input_queue ) ||
+            event_loop_add( &event_loop, input_queue.wake_fd, EPOLLIN, input_queue_event, NULL )) {
+            exit(1);
+        }
+        if (pthread_create( &input_tid, NULL, input_thread, NULL )) {
+            LOG_ERRNO( "pthread_create" );
+            exit(1);
+        }
+    } else if (start_devices( &event_loop )) {
+        exit(1);
+    }
+
+    connect_cnc();
+    show_state();
+
+    // The main loop we operate in.  Each pass blocks until the
+    // shuttle device or a switch (or the input thread), the transport
+    // or one of the timers has something for us, so a jog click is handled as
+    // soon as the kernel delivers it and nothing runs while the dial
+    // is idle.  Reconnecting to SPJS and reopening the jog controllers
+    // happen in here too, driven by timers and udev.
+    while (1) {
+
+        // if we have lost the connection to SPJS or the controller, or if we have
+        // a request to reconnect everything, start over.
+        if (reconnect_requested || (!cnc_connected && !cnc_connecting && !cnc_retry_pending)) {
+            reset_connections();
+        }
+
+        // the replay starts as soon as there is somewhere to send it
+        if (replaying && !replay_started && cnc_connected) {
+            replay_start_allocations = bench_allocations ? bench_allocations() : 0;
+            replay_start_us = stats_now_us();
+            if (replay_start( &event_loop, replay_speed, replay_event, pipeline_idle )) {
+                exit(1);
             }
+            replay_started = 1;
         }
 
-        close(fd);
-        sleep(1);
+        if (event_loop_run_once( &event_loop, -1 ) < 0) {
+            reconnect_requested = 1;
+            continue;
+        }
+        pass_start_us = stats_now_us();
+
+        if (cnc_connected) {
+            send_queued_cmds();
+        } else {
+            drop_queued_cmds();
+        }
+
+        // update LEDs
+        show_state();
+
+        // all the work for this pass is done, now the log can go out
+        log_flush();
+        pass_us = stats_now_us() - pass_start_us;
+        stats_record( STATS_LOOP_WORK, pass_us );
+        if (pass_us > CYCLE_TIME_MICROSECONDS) {
+            stats_count( STATS_LOOP_OVERRUNS, 1 );
+        }
+
+        if (replay_started && replay_done() && pipeline_idle()) {
+            replay_report( replay_start_us, replay_start_allocations );
+            exit(0);
+        }
     }
 }
@@ -0,0 +1,208 @@
+#include "stats.h"
+#include <string.h>
+#include <time.h>
+
+static STATS_HISTOGRAM histograms[STATS_COUNT];
+static unsigned long   counters[STATS_NUM_COUNTERS];
+static long            gauges[STATS_NUM_GAUGES];
+
+static const char *stats_names[STATS_COUNT] = {
+    "event -> queue",
+    "queue -> wire",
+    "event -> wire",
+    "switch -> wire",
+    "loop work",
+    "wakeup late",
+};
+
+// Prometheus names and labels for the above
+static const char *histogram_metrics[STATS_COUNT][2] = {
+    { "shuttlecp_latency_seconds",   "path=\"event_to_queue\"" },
+    { "shuttlecp_latency_seconds",   "path=\"queue_to_wire\"" },
+    { "shuttlecp_latency_seconds",   "path=\"event_to_wire\"" },
+    { "shuttlecp_latency_seconds",   "path=\"switch_to_wire\"" },
+    { "shuttlecp_loop_work_seconds", "" },
+    { "shuttlecp_wakeup_late_seconds", "" },
+};
+
+static const char *counter_metrics[STATS_NUM_COUNTERS] = {
+    "shuttlecp_events_total{type=\"key\"}",
+    "shuttlecp_events_total{type=\"jog\"}",
+    "shuttlecp_events_total{type=\"shuttle\"}",
+    "shuttlecp_events_total{type=\"dropped\"}",
+    "shuttlecp_commands_queued_total",
+    "shuttlecp_commands_dropped_total",
+    "shuttlecp_commands_sent_total",
+    "shuttlecp_commands_failed_total",
+    "shuttlecp_reconnects_total",
+    "shuttlecp_connect_failures_total",
+    "shuttlecp_cycle_overruns_total",
+    "shuttlecp_loop_overruns_total",
+};
+
+static const char *gauge_metrics[STATS_NUM_GAUGES] = {
+    "shuttlecp_queue_depth",
+    "shuttlecp_cnc_connected",
+    "shuttlecp_devices_connected",
+};
+
+
+// Microseconds on CLOCK_MONOTONIC, the clock the jog controller's
+// events are stamped with once EVIOCSCLOCKID has been set.
+long long stats_now_us( void ) {
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// an input_event timestamp in the same units
+long long stats_timeval_us( const struct timeval *tv ) {
+    return tv->tv_sec * 1000000LL + tv->tv_usec;
+}
+
+
+// Values below 8 get a bucket each; above that each power of two is
+// split into eight buckets on its top three bits.
+static int stats_bucket( long long us ) {
+    int e = 3;
+
+    if (us < 8)
+        return us;
+    if (us > 0x7fffffffLL)
+        us = 0x7fffffffLL;
+    while ((us >> (e + 1)) != 0)
+        e++;
+    return (e - 2) * 8 + ((us >> (e - 3)) & 7);
+}
+
+// largest value that lands in bucket b
+static long long stats_bucket_top( int b ) {
+    int e = b / 8 + 2;
+
+    if (b < 8)
+        return b;
+    return ((long long)(8 + b % 8 + 1) << (e - 3)) - 1;
+}
+
+
+void stats_record( STATS_ID id, long long us ) {
+    STATS_HISTOGRAM *h = &histograms[id];
+
+    if (us < 0)
+        us = 0;         // the clocks can disagree by a little
+    h->count++;
+    h->sum_us += us;
+    if (us > h->max_us)
+        h->max_us = us;
+    h->buckets[stats_bucket( us )]++;
+}
+
+
+// The value below which the given fraction of the samples fall, or -1
+// if nothing has been recorded.
+long long stats_percentile( STATS_ID id, double fraction ) {
+    STATS_HISTOGRAM *h = &histograms[id];
+    unsigned long seen = 0;
+    int b;
+
+    if (h->count == 0)
+        return -1;
+    for (b = 0; b < STATS_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= fraction * h->count)
+            break;
+    }
+    if (b == STATS_BUCKETS || stats_bucket_top( b ) > h->max_us)
+        return h->max_us;
+    return stats_bucket_top( b );
+}
+
+
+const STATS_HISTOGRAM *stats_histogram( STATS_ID id ) {
+    return &histograms[id];
+}
+
+
+void stats_dump( FILE *out ) {
+    STATS_HISTOGRAM *h;
+    int i;
+
+    fprintf(out, "latency (us)       count      mean       p50       p99       max\n");
+    for (i = 0; i < STATS_COUNT; i++) {
+        h = &histograms[i];
+        fprintf(out, "%-14s %9lu %9llu %9lld %9lld %9lld\n", stats_names[i], h->count,
+                h->count ? h->sum_us / h->count : 0,
+                stats_percentile( i, 0.50 ), stats_percentile( i, 0.99 ), h->max_us);
+    }
+    fflush(out);
+}
+
+
+void stats_count( STATS_COUNTER id, unsigned long n ) {
+    counters[id] += n;
+}
+
+
+unsigned long stats_counter( STATS_COUNTER id ) {
+    return counters[id];
+}
+
+
+void stats_gauge( STATS_GAUGE id, long value ) {
+    gauges[id] = value;
+}
+
+
+// The "# TYPE" line for the family metric belongs to, or nothing if
+// prev, the metric before it, was of the same family and had it
+static int prometheus_type( char *buf, int size, const char *metric, const char *prev, const char *type ) {
+    int n = strcspn( metric, "{" );
+
+    if (prev && strncmp( prev, metric, n ) == 0 && (prev[n] == '{' || prev[n] == '\0'))
+        return 0;
+    return snprintf( buf, size, "# TYPE %.*s %s\n", n, metric, type );
+}
+
+
+// Everything in the Prometheus text format, the histograms as summaries
+// with a median and a 99th percentile.  Returns the length, or -1 if
+// it doesn't all fit in buf.
+int stats_prometheus( char *buf, int size ) {
+    static const double quantiles[2] = { 0.50, 0.99 };
+    const char *name, *labels, *sep;
+    STATS_HISTOGRAM *h;
+    int i, q, len = 0;
+    long long us;
+
+    for (i = 0; i < STATS_NUM_COUNTERS && len < size; i++) {
+        len += prometheus_type( buf + len, size - len, counter_metrics[i],
+                                i ? counter_metrics[i-1] : NULL, "counter" );
+        if (len < size)
+            len += snprintf( buf + len, size - len, "%s %lu\n", counter_metrics[i], counters[i] );
+    }
+    for (i = 0; i < STATS_NUM_GAUGES && len < size; i++) {
+        len += prometheus_type( buf + len, size - len, gauge_metrics[i], NULL, "gauge" );
+        if (len < size)
+            len += snprintf( buf + len, size - len, "%s %ld\n", gauge_metrics[i], gauges[i] );
+    }
+    for (i = 0; i < STATS_COUNT && len < size; i++) {
+        h      = &histograms[i];
+        name   = histogram_metrics[i][0];
+        labels = histogram_metrics[i][1];
+        sep    = labels[0] ? "," : "";
+        len += prometheus_type( buf + len, size - len, name,
+                                i ? histogram_metrics[i-1][0] : NULL, "summary" );
+        for (q = 0; q < 2 && len < size; q++) {
+            us = stats_percentile( i, quantiles[q] );
+            len += snprintf( buf + len, size - len, "%s{%s%squantile=\"%.2f\"} %.6f\n",
+                             name, labels, sep, quantiles[q], us < 0 ? 0.0 : us / 1e6 );
+        }
+        if (len < size) {
+            len += snprintf( buf + len, size - len, "%s_sum%s%s%s %.6f\n%s_count%s%s%s %lu\n",
+                             name, sep[0] ? "{" : "", labels, sep[0] ? "}" : "", h->sum_us / 1e6,
+                             name, sep[0] ? "{" : "", labels, sep[0] ? "}" : "", h->count );
+        }
+    }
+    return len < size ? len : -1;
+}
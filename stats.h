@@ -0,0 +1,67 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <sys/time.h>
+
+// Latency histograms.  Buckets are powers of two split into eight, so
+// a percentile read back is within 12.5% of the real value.
+// Alongside them are plain counters and gauges, and all of it can be
+// rendered in the Prometheus text format for the metrics endpoint.
+#define STATS_BUCKETS 240
+
+// What is being timed
+typedef enum {
+    STATS_EVENT_TO_QUEUE    = 0,   // evdev timestamp to command queued
+    STATS_QUEUE_TO_WIRE     = 1,   // command queued to handed to the kernel
+    STATS_EVENT_TO_WIRE     = 2,   // evdev timestamp to handed to the kernel
+    STATS_REALTIME_TO_WIRE  = 3,   // first edge of a switch press to real-time command sent
+    STATS_LOOP_WORK         = 4,   // one pass of the main loop, from wake up to done
+    STATS_WAKEUP_LATE       = 5,   // jitter probe: how late its timer woke us
+    STATS_COUNT             = 6,
+} STATS_ID;
+
+// What is being counted
+typedef enum {
+    STATS_EVENTS_KEY        = 0,   // button events handled
+    STATS_EVENTS_JOG        = 1,   // dial events handled
+    STATS_EVENTS_SHUTTLE    = 2,   // wheel events handled
+    STATS_EVENTS_DROPPED    = 3,   // SYN_DROPPED from the kernel
+    STATS_CMDS_QUEUED       = 4,   // commands pushed onto a queue
+    STATS_CMDS_DROPPED      = 5,   // commands refused or lost to a full queue
+    STATS_CMDS_SENT         = 6,   // commands the transport got out (bCNC: once it answered)
+    STATS_CMDS_FAILED       = 7,   // commands lost to a failed send or request
+    STATS_RECONNECTS        = 8,   // reset_connections()
+    STATS_CONNECT_FAILURES  = 9,   // attempts to connect that didn't work
+    STATS_CYCLE_OVERRUNS    = 10,  // shuttle resend cycles missed because we were late
+    STATS_LOOP_OVERRUNS     = 11,  // main loop passes that took longer than a resend cycle
+    STATS_NUM_COUNTERS      = 12,
+} STATS_COUNTER;
+
+// What is being measured right now
+typedef enum {
+    STATS_QUEUE_DEPTH       = 0,   // commands waiting in all the queues
+    STATS_CNC_CONNECTED     = 1,   // 1 while SPJS, bCNC or the controller is reachable
+    STATS_DEVICES_CONNECTED = 2,   // jog controllers open
+    STATS_NUM_GAUGES        = 3,
+} STATS_GAUGE;
+
+typedef struct {
+    unsigned long      count;
+    unsigned long long sum_us;
+    long long          max_us;
+    unsigned long      buckets[STATS_BUCKETS];
+} STATS_HISTOGRAM;
+
+long long stats_now_us( void );
+long long stats_timeval_us( const struct timeval *tv );
+void      stats_record( STATS_ID id, long long us );
+long long stats_percentile( STATS_ID id, double fraction );
+const STATS_HISTOGRAM *stats_histogram( STATS_ID id );
+void      stats_dump( FILE *out );
+void      stats_count( STATS_COUNTER id, unsigned long n );
+unsigned long stats_counter( STATS_COUNTER id );
+void      stats_gauge( STATS_GAUGE id, long value );
+int       stats_prometheus( char *buf, int size );
+
+#endif   /* STATS_H - do not put anything below this line! */
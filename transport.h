@@ -0,0 +1,55 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <time.h>
+#include "websocket.h"
+#include "event_loop.h"
+
+// How commands get from us to the machine.  shuttlecp only talks to the
+// TRANSPORT it picked at startup: commands are handed over per port (one
+// port for each jog controller, on the serial port it drives), and
+// whatever comes back is reported through the TRANSPORT_HANDLERS.  Each
+// backend watches its own file descriptors in the event loop, so there
+// is nothing to poll.
+#define TRANSPORT_MAX_PORTS 4
+
+#define SERIAL_RX_BUFFER    128       // bytes the controller's serial receive buffer holds (GRBL: 128)
+#define SERIAL_MAX_LINES    32        // lines sent but not yet answered, per serial port
+#define SERIAL_MAX_LINE     256       // longest line of controller output we keep
+
+typedef struct {
+    const char *host;                   // SPJS or bCNC
+    const char *port;
+    BATCH_MODE batch_mode;              // SPJS framing
+    int        baud;                    // direct serial
+} TRANSPORT_SETTINGS;
+
+typedef struct {
+    void (*connected)( void );          // connect() finished the job it started
+    void (*failed)( void );             // connecting failed, or the connection was lost
+    void (*message)( const char* msg, int len );                // an SPJS message, for whichever port its "P" names
+    void (*controller_line)( int port, const char* line, int len );  // a line of controller output
+    void (*replies_done)( void );       // everything that had arrived has been passed on
+} TRANSPORT_HANDLERS;
+
+typedef struct {
+    const char *name;
+    int  one_machine;                   // every port ends up at the same machine (bCNC)
+    int  feedback;                      // the controller's replies reach us, so STREAM_PACING works
+    int  broadcasts;                    // CMD_BROADCAST reaches other clients; elsewhere it is dropped
+    int  controller_setup;              // the controller's settings are ours to make
+    int  (*init)( EVENT_LOOP* loop, const TRANSPORT_SETTINGS* settings, const TRANSPORT_HANDLERS* handlers );
+    int  (*add_port)( int port, const char* serial );
+    int  (*connect)( void );            // 1 connected, 0 under way (then connected() or failed()), -1 failed
+    void (*close)( void );
+    int  (*busy)( void );               // earlier output is still going out
+    int  (*send)( int port, Queue* queue );      // commands taken from the queue, -1 if the connection failed
+                                                 // (what didn't go out is left queued)
+    int  (*send_realtime)( int port, const char* cmd, const struct timespec* detected );  // 0, or -1
+} TRANSPORT;
+
+extern const TRANSPORT transport_spjs;      // websocket to SPJS (ChiliPeppr)
+extern const TRANSPORT transport_bcnc;      // bCNC's HTTP "send"
+extern const TRANSPORT transport_serial;    // straight to the controller's USB serial port
+
+#endif   /* TRANSPORT_H - do not put anything below this line! */
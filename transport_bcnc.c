@@ -0,0 +1,63 @@
+#include "transport.h"
+#include "http.h"
+#include "log.h"
+
+// bCNC backend: every port ends up at the one machine bCNC is connected
+// to, and nothing comes back but whether a request was accepted.
+
+static const TRANSPORT_SETTINGS *bcnc_settings;
+
+
+static int bcnc_init( EVENT_LOOP* loop, const TRANSPORT_SETTINGS* settings, const TRANSPORT_HANDLERS* handlers ) {
+    (void)handlers;
+    bcnc_settings = settings;
+    return http_init( loop, settings->host, settings->port );
+}
+
+
+static int bcnc_add_port( int port, const char* serial ) {
+    (void)port;
+    (void)serial;
+    return 0;
+}
+
+
+// Each request stands on its own, so there is nothing to set up
+static int bcnc_connect() {
+    LOG_INFO( "HTTP used for bCNC." );
+    return 1;
+}
+
+
+// abandon any request in flight
+static void bcnc_close() {
+    http_reset();
+}
+
+
+static int bcnc_busy() {
+    return http_busy();
+}
+
+
+static int bcnc_send( int port, Queue* queue ) {
+    (void)port;
+    return http_send_cmds( queue );
+}
+
+
+static int bcnc_send_realtime( int port, const char* cmd, const struct timespec* detected ) {
+    char line[WEBSOCKET_MAX_REALTIME + 2];
+
+    (void)port;
+    snprintf( line, sizeof(line), "%s\n", cmd );
+    return http_send_realtime( line, detected );
+}
+
+
+const TRANSPORT transport_bcnc = {
+    "bCNC",
+    1, 0, 0, 0,
+    bcnc_init, bcnc_add_port, bcnc_connect, bcnc_close,
+    bcnc_busy, bcnc_send, bcnc_send_realtime,
+};
@@ -0,0 +1,399 @@
+#include "transport.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+// Direct serial backend: we are the controller's only client and talk
+// to its USB serial port ourselves, with no SPJS in between.  Flow
+// control is GRBL's character counting: the controller answers every
+// line with "ok" or "error" (TinyG with {"r":...}), so we know how much
+// of its receive buffer our unanswered lines still take up, and only
+// send a line once it fits.  Lines that don't fit stay in the queue
+// until the answers make room for them.
+
+typedef struct {
+    const char *path;
+    int        fd;                          // -1 while it isn't open
+    int        owner;                       // the port its output is reported for
+    short int  ready;                       // the controller has said something
+    int        rx_used;                     // bytes of unanswered lines in its receive buffer
+    int        line_len[SERIAL_MAX_LINES];  // length of each unanswered line, oldest first
+    int        line_head;
+    int        line_count;
+    char       line[SERIAL_MAX_LINE];       // controller output since the last newline
+    int        line_used;
+    char       out[SERIAL_RX_BUFFER];       // the unwritten rest of a command write() cut short
+    int        out_len;
+    long long  out_queued_us, out_event_us; // that command's timestamps
+    short int  writing;                     // waiting for the port to become writable
+} SERIAL_PORT;
+
+static EVENT_LOOP               *serial_loop;
+static const TRANSPORT_SETTINGS *serial_settings;
+static const TRANSPORT_HANDLERS *serial_handlers;
+static SERIAL_PORT              serial_ports[TRANSPORT_MAX_PORTS];
+static int                      port_map[TRANSPORT_MAX_PORTS];   // port -> serial_ports[]
+static int                      num_serial_ports = 0;
+static int                      serial_connecting = 0;
+
+
+static speed_t serial_speed( int baud ) {
+    switch (baud) {
+        case 9600:   return B9600;
+        case 19200:  return B19200;
+        case 38400:  return B38400;
+        case 57600:  return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        default:     return 0;
+    }
+}
+
+
+// forget the lines in flight, the controller has forgotten them too
+static void serial_reset_counts( SERIAL_PORT *sp ) {
+    sp->rx_used    = 0;
+    sp->line_head  = 0;
+    sp->line_count = 0;
+    sp->out_len    = 0;
+}
+
+
+// One line of controller output.  Answers free the room their line
+// took up; a start up banner means the controller was reset and threw
+// away whatever it had in its buffer.
+static void serial_line( SERIAL_PORT *sp, const char *line, int len ) {
+    int i;
+
+    if ((len >= 2 && memcmp( line, "ok", 2 ) == 0) ||
+        (len >= 5 && memcmp( line, "error", 5 ) == 0) ||
+        (len >= 5 && memcmp( line, "{\"r\":", 5 ) == 0)) {
+        if (sp->line_count > 0) {
+            sp->rx_used  -= sp->line_len[sp->line_head];
+            sp->line_head = (sp->line_head + 1) % SERIAL_MAX_LINES;
+            sp->line_count--;
+        }
+    } else if (len >= 5 && memcmp( line, "Grbl ", 5 ) == 0) {
+        LOG_INFO( "%s: %.*s", sp->path, len, line );
+        serial_reset_counts( sp );
+    }
+    serial_handlers->controller_line( sp->owner, line, len );
+
+    if (!sp->ready) {
+        sp->ready = 1;
+        for (i = 0; i < num_serial_ports && serial_ports[i].ready; i++)
+            ;
+        if (serial_connecting && i == num_serial_ports) {
+            serial_connecting = 0;
+            serial_handlers->connected();
+        }
+    }
+}
+
+
+// Only ask for EPOLLOUT while there is output waiting for the port
+static void serial_want_write( SERIAL_PORT *sp, int writing ) {
+    if (sp->writing != writing) {
+        event_loop_modify( serial_loop, sp->fd, EPOLLIN | (writing ? EPOLLOUT : 0) );
+        sp->writing = writing;
+    }
+}
+
+
+// Write what is left of a command the last write() cut short.  Returns
+// -1 if the port has failed.
+static int serial_flush( SERIAL_PORT *sp ) {
+    long long now_us;
+    int n;
+
+    if (sp->out_len > 0) {
+        n = write( sp->fd, sp->out, sp->out_len );
+        if (n < 0 && errno != EAGAIN) {
+            LOG_ERRNO( sp->path );
+            return -1;
+        }
+        if (n > 0) {
+            sp->rx_used += n;
+            sp->out_len -= n;
+            memmove( sp->out, sp->out + n, sp->out_len );
+            if (sp->out_len == 0) {
+                now_us = stats_now_us();
+                stats_record( STATS_QUEUE_TO_WIRE, now_us - sp->out_queued_us );
+                if (sp->out_event_us) {
+                    stats_record( STATS_EVENT_TO_WIRE, now_us - sp->out_event_us );
+                }
+            }
+        }
+    }
+    serial_want_write( sp, sp->out_len > 0 );
+    return 0;
+}
+
+
+// Event loop handler for a serial port: finish off a cut short write,
+// and split what arrived into lines
+static void serial_event( int fd, unsigned int events, void *data ) {
+    SERIAL_PORT *sp = data;
+    char buf[512];
+    int i, n;
+
+    if ((events & EPOLLOUT) && serial_flush( sp )) {
+        serial_handlers->failed();
+        return;
+    }
+    while ((n = read( fd, buf, sizeof(buf) )) > 0) {
+        for (i = 0; i < n; i++) {
+            if (buf[i] == '\n') {
+                serial_line( sp, sp->line, sp->line_used );
+                sp->line_used = 0;
+            } else if (buf[i] != '\r' && sp->line_used < SERIAL_MAX_LINE) {
+                sp->line[sp->line_used++] = buf[i];
+            }
+        }
+    }
+    if (n == 0 || (n < 0 && errno != EAGAIN) || (events & (EPOLLERR | EPOLLHUP))) {
+        LOG_ERROR( "Lost the serial port %s", sp->path );
+        serial_handlers->failed();
+        return;
+    }
+    serial_handlers->replies_done();
+}
+
+
+static int serial_init( EVENT_LOOP* loop, const TRANSPORT_SETTINGS* settings, const TRANSPORT_HANDLERS* handlers ) {
+    serial_loop     = loop;
+    serial_settings = settings;
+    serial_handlers = handlers;
+    if (serial_speed( settings->baud ) == 0) {
+        LOG_ERROR( "Unsupported baud rate %d", settings->baud );
+        return 1;
+    }
+    return 0;
+}
+
+
+// Jog controllers driving the same machine share its serial port
+static int serial_add_port( int port, const char* serial ) {
+    int i;
+
+    for (i = 0; i < num_serial_ports; i++) {
+        if (strcmp( serial_ports[i].path, serial ) == 0) {
+            port_map[port] = i;
+            return 0;
+        }
+    }
+    memset( &serial_ports[i], 0, sizeof(serial_ports[i]) );
+    serial_ports[i].path  = serial;
+    serial_ports[i].fd    = -1;
+    serial_ports[i].owner = port;
+    port_map[port] = i;
+    num_serial_ports++;
+    return 0;
+}
+
+
+// 8N1, raw, at the configured speed
+static int serial_open( SERIAL_PORT *sp ) {
+    struct termios tio;
+    speed_t speed = serial_speed( serial_settings->baud );
+
+    sp->fd = open( sp->path, O_RDWR | O_NOCTTY | O_NONBLOCK );
+    if (sp->fd < 0) {
+        LOG_ERRNO( sp->path );
+        return -1;
+    }
+    if (tcgetattr( sp->fd, &tio ) < 0) {
+        LOG_ERRNO( "tcgetattr" );
+        return -1;
+    }
+    cfmakeraw( &tio );
+    tio.c_cflag |= CLOCAL | CREAD;
+    cfsetispeed( &tio, speed );
+    cfsetospeed( &tio, speed );
+    if (tcsetattr( sp->fd, TCSANOW, &tio ) < 0) {
+        LOG_ERRNO( "tcsetattr" );
+        return -1;
+    }
+    tcflush( sp->fd, TCIOFLUSH );
+    return event_loop_add( serial_loop, sp->fd, EPOLLIN, serial_event, sp );
+}
+
+
+// Open every serial port and poke the controllers with an empty line.
+// Connected once each of them has answered, or printed its banner
+// after the reset opening the port causes on most Arduinos.
+static int serial_connect() {
+    SERIAL_PORT *sp;
+    int i;
+
+    for (i = 0; i < num_serial_ports; i++) {
+        sp = &serial_ports[i];
+        LOG_DEBUG( "Opening %s at %d baud", sp->path, serial_settings->baud );
+        sp->ready     = 0;
+        sp->line_used = 0;
+        sp->writing   = 0;
+        serial_reset_counts( sp );
+        if (serial_open( sp ))
+            return -1;
+        if (write( sp->fd, "\n", 1 ) == 1) {
+            sp->rx_used  = 1;
+            sp->line_len[0] = 1;
+            sp->line_count  = 1;
+        }
+    }
+    serial_connecting = 1;
+    return 0;
+}
+
+
+static void serial_close() {
+    int i;
+
+    for (i = 0; i < num_serial_ports; i++) {
+        if (serial_ports[i].fd >= 0) {
+            event_loop_remove( serial_loop, serial_ports[i].fd );
+            close( serial_ports[i].fd );
+            serial_ports[i].fd = -1;
+        }
+    }
+    serial_connecting = 0;
+}
+
+
+// Lines are only written once they fit in the controller's buffer, so
+// the port is only busy if write() cut one short
+static int serial_busy() {
+    int i;
+
+    for (i = 0; i < num_serial_ports; i++) {
+        if (serial_ports[i].writing)
+            return 1;
+    }
+    return 0;
+}
+
+
+// Write as many whole queued commands as the controller has room for.
+// There is nobody to broadcast to, so broadcasts are dropped.  Only
+// what write() takes counts as sent: commands it didn't get to stay
+// queued, and the rest of one it cut short waits in sp->out for the
+// port to become writable.
+static int serial_send( int port, Queue* queue ) {
+    SERIAL_PORT *sp = &serial_ports[port_map[port]];
+    char buf[SERIAL_RX_BUFFER], cmd[MAX_CMD_LENGTH];
+    int  ends[QUEUE_CAPACITY];              // where each command ends in buf
+    CMD_TYPE type;
+    int len = 0, num_taken = 0, num_sent = 0, lines = sp->line_count;
+    int line_len, start, i, n;
+    long long now_us;
+    QueueEntry *e;
+
+    if (sp->writing)
+        return 0;
+    while (queue->size > num_taken) {
+        e = queue->at( queue, num_taken );
+        if (e->type == CMD_GCODE) {
+            // every line of it has to fit, or none of it goes
+            for (i = 0, n = lines; i < e->len; i++) {
+                if (e->cmd[i] == '\n')
+                    n++;
+            }
+            if (sp->rx_used + len + e->len > SERIAL_RX_BUFFER || n > SERIAL_MAX_LINES)
+                break;
+            memcpy( buf + len, e->cmd, e->len );
+            len  += e->len;
+            lines = n;
+        }
+        ends[num_taken++] = len;
+    }
+    if (num_taken == 0 && queue->size > 0 && sp->rx_used == 0) {
+        // it will never fit, don't let it block the ones behind it
+        LOG_ERROR( "Command too long for %s: %s", sp->path, queue->at( queue, 0 )->cmd );
+        queue->pop( queue, &type, cmd );
+        stats_count( STATS_CMDS_FAILED, 1 );
+        return 1;
+    }
+    if (len == 0) {
+        for (i = 0; i < num_taken; i++) {
+            queue->pop( queue, &type, cmd );
+        }
+        return num_taken;
+    }
+
+    n = write( sp->fd, buf, len );
+    if (n < 0) {
+        if (errno != EAGAIN) {
+            LOG_ERRNO( sp->path );
+            return -1;
+        }
+        n = 0;
+    }
+    sp->rx_used += n;
+
+    // the commands write() got to are the controller's now, their lines
+    // are answered one by one
+    now_us = stats_now_us();
+    for (start = 0; num_sent < num_taken && (start < n || ends[num_sent] <= n); num_sent++) {
+        e = queue->at( queue, 0 );
+        for (i = 0, line_len = 0; i < e->len && e->type == CMD_GCODE; i++) {
+            line_len++;
+            if (e->cmd[i] == '\n') {
+                sp->line_len[(sp->line_head + sp->line_count++) % SERIAL_MAX_LINES] = line_len;
+                line_len = 0;
+            }
+        }
+        if (ends[num_sent] > n) {
+            sp->out_len = ends[num_sent] - n;
+            memcpy( sp->out, buf + n, sp->out_len );
+            sp->out_queued_us = e->queued_us;
+            sp->out_event_us  = e->event_us;
+        } else if (e->type == CMD_GCODE) {
+            stats_record( STATS_QUEUE_TO_WIRE, now_us - e->queued_us );
+            if (e->event_us) {
+                stats_record( STATS_EVENT_TO_WIRE, now_us - e->event_us );
+            }
+        }
+        start = ends[num_sent];
+        queue->pop( queue, &type, cmd );
+    }
+    if (n < len) {
+        serial_want_write( sp, 1 );
+    }
+    stats_count( STATS_CMDS_SENT, num_sent );
+    LOG_DEBUG( "Sent %d commands to %s", num_sent, sp->path );
+    return num_sent;
+}
+
+
+// Real-time commands skip the receive buffer.  The profiles give them
+// UTF-8 encoded, as SPJS needs them; the controller wants the byte.
+static int serial_send_realtime( int port, const char* cmd, const struct timespec* detected ) {
+    SERIAL_PORT *sp = &serial_ports[port_map[port]];
+    struct timespec now;
+    unsigned char byte;
+    long latency_us;
+
+    byte = (unsigned char)cmd[0];
+    if ((byte & 0xe0) == 0xc0 && cmd[1]) {
+        byte = ((byte & 0x1f) << 6) | ((unsigned char)cmd[1] & 0x3f);
+    }
+    if (write( sp->fd, &byte, 1 ) != 1) {
+        LOG_ERRNO( sp->path );
+        return -1;
+    }
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    latency_us = (now.tv_sec - detected->tv_sec) * 1000000L +
+                 (now.tv_nsec - detected->tv_nsec) / 1000;
+    stats_record( STATS_REALTIME_TO_WIRE, latency_us );
+    return 0;
+}
+
+
+const TRANSPORT transport_serial = {
+    "serial",
+    0, 1, 0, 1,
+    serial_init, serial_add_port, serial_connect, serial_close,
+    serial_busy, serial_send, serial_send_realtime,
+};
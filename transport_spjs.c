@@ -0,0 +1,187 @@
+#include "transport.h"
+#include "log.h"
+
+// SPJS backend: commands go out over the websocket as "send" frames for
+// the serial port each jog controller drives, and SPJS's messages,
+// including what the controllers print, come back over it.
+
+static EVENT_LOOP               *spjs_loop;
+static const TRANSPORT_SETTINGS *spjs_settings;
+static const TRANSPORT_HANDLERS *spjs_handlers;
+static WEBSOCKET_PORT           spjs_ports[TRANSPORT_MAX_PORTS];
+static unsigned int             spjs_events;
+static int                      spjs_connecting = 0;   // connect or websocket handshake under way
+static int                      spjs_stall_fd = -1;    // fires when a partial write may have stalled
+
+
+// Only ask for EPOLLOUT while there is output waiting for the socket,
+// and time how long we wait for it: if SPJS stops reading, EPOLLOUT
+// never comes and nothing else would notice.
+static void spjs_update_events() {
+    unsigned int events = EPOLLIN | (websocket_want_write() ? EPOLLOUT : 0);
+    long left_us;
+
+    if (events != spjs_events) {
+        event_loop_modify( spjs_loop, websocket_socket(), events );
+        spjs_events = events;
+        left_us = websocket_stall_left_us();
+        if (!(events & EPOLLOUT)) {
+            timer_once( spjs_stall_fd, 0 );
+        } else {
+            // a zero delay would disarm the timer, so round up to 1us
+            timer_once( spjs_stall_fd, left_us < 0 ? WEBSOCKET_STALL_US : left_us > 0 ? left_us : 1 );
+        }
+    }
+}
+
+
+// Event loop handler for the stall timer
+static void spjs_stall_event( int fd, unsigned int events, void* data ) {
+    long left_us;
+
+    (void)events;
+    (void)data;
+    timer_ack( fd );
+    left_us = websocket_stall_left_us();
+    if (left_us == 0) {
+        LOG_ERROR( "Websocket write stalled with %d bytes pending", websocket_pending_bytes() );
+        spjs_handlers->failed();
+    } else if (left_us > 0) {
+        timer_once( fd, left_us );
+    } else if (spjs_events & EPOLLOUT) {
+        timer_once( fd, WEBSOCKET_STALL_US );
+    }
+}
+
+
+// Event loop handler for the websocket.  This is also where we find
+// out that the connection has been closed.
+static void spjs_event( int fd, unsigned int events, void* data ) {
+    int ready;
+
+    (void)fd;
+    (void)data;
+    if (spjs_connecting) {
+        ready = websocket_handshake();
+        if (ready == 0 && (events & (EPOLLERR | EPOLLHUP))) {
+            ready = -1;
+        }
+        if (ready > 0) {
+            spjs_connecting = 0;
+            spjs_handlers->connected();
+        } else if (ready < 0) {
+            spjs_handlers->failed();
+        }
+        return;
+    }
+    if ((events & EPOLLOUT) && websocket_flush()) {
+        spjs_handlers->failed();
+        return;
+    }
+    if (websocket_read_msgs( spjs_handlers->message ) ||
+        (events & (EPOLLERR | EPOLLHUP))) {
+        spjs_handlers->failed();
+        return;
+    }
+    spjs_update_events();
+    spjs_handlers->replies_done();
+}
+
+
+// Event loop handler for the connect thread finishing.  Once the
+// socket is connected the handshake goes on in spjs_event().
+static void spjs_connect_event( int fd, unsigned int events, void* data ) {
+    int ret;
+
+    (void)fd;
+    (void)events;
+    (void)data;
+    ret = websocket_connected();
+    if (ret == 0)
+        return;                             // closed while it was connecting
+    if (ret < 0) {
+        spjs_handlers->failed();
+        return;
+    }
+    spjs_events = EPOLLIN;
+    if (event_loop_add( spjs_loop, websocket_socket(), spjs_events, spjs_event, NULL )) {
+        spjs_handlers->failed();
+    }
+}
+
+
+static int spjs_init( EVENT_LOOP* loop, const TRANSPORT_SETTINGS* settings, const TRANSPORT_HANDLERS* handlers ) {
+    int connect_fd = websocket_connect_fd();
+
+    spjs_loop     = loop;
+    spjs_settings = settings;
+    spjs_handlers = handlers;
+
+    spjs_stall_fd = timer_new();
+    if (spjs_stall_fd < 0 || connect_fd < 0 ||
+        event_loop_add( loop, spjs_stall_fd, EPOLLIN, spjs_stall_event, NULL ) ||
+        event_loop_add( loop, connect_fd, EPOLLIN, spjs_connect_event, NULL ))
+        return -1;
+    return 0;
+}
+
+
+static int spjs_add_port( int port, const char* serial ) {
+    return websocket_port_init( &spjs_ports[port], serial );
+}
+
+
+// Only starts connecting: the TCP connect runs on websocket.c's connect
+// thread, and spjs_connect_event() and spjs_event() see the handshake
+// through, so jog input keeps being handled while SPJS takes its time
+// or can't be reached at all.
+static int spjs_connect() {
+    LOG_DEBUG( "Attempting connection to %s:%s", spjs_settings->host, spjs_settings->port );
+    if (websocket_init( spjs_settings->host, spjs_settings->port ))
+        return -1;
+    spjs_connecting = 1;
+    return 0;
+}
+
+
+static void spjs_close() {
+    event_loop_remove( spjs_loop, websocket_socket() );
+    websocket_close();
+    spjs_connecting = 0;
+    spjs_events = 0;
+    timer_once( spjs_stall_fd, 0 );
+}
+
+
+static int spjs_busy() {
+    return websocket_want_write();
+}
+
+
+// Everything queued goes out; anything that doesn't means the
+// connection is in trouble
+static int spjs_send( int port, Queue* queue ) {
+    int num_cmds_in_queue = queue->size;
+    int num_cmds_sent = websocket_send_cmds( queue, &spjs_ports[port], spjs_settings->batch_mode );
+
+    if (num_cmds_sent != num_cmds_in_queue)
+        return -1;
+    spjs_update_events();
+    return num_cmds_sent;
+}
+
+
+static int spjs_send_realtime( int port, const char* cmd, const struct timespec* detected ) {
+    if (websocket_send_realtime( &spjs_ports[port], cmd, detected ))
+        return -1;
+    spjs_update_events();
+    return 0;
+}
+
+
+const TRANSPORT transport_spjs = {
+    "SPJS",
+    0, 1, 1, 1,
+    spjs_init, spjs_add_port, spjs_connect, spjs_close,
+    spjs_busy, spjs_send, spjs_send_realtime,
+};
@@ -1,173 +1,665 @@
 #include "websocket.h"
+#include "log.h"
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 noPollConn* websocket_conn = NULL;
+static noPollCtx* websocket_ctx = NULL;
 
+// The name lookup and TCP connect can block for up to
+// WEBSOCKET_CONNECT_US, so they run on a thread of their own.  While
+// it runs nothing else touches noPoll; it leaves the new connection
+// in connect_result and wakes the event loop through connect_fd.
+static int  connect_fd = -1;
+static int  connect_running = 0;        // the connect thread hasn't reported back yet
+static int  connect_wanted = 0;         // and its connection is still wanted
+static char connect_host[256];
+static char connect_port[32];
+static _Atomic(noPollConn*) connect_result;
+
+// Frames waiting to be handed to noPoll, each stored as a two byte
+// length and a two byte count of the commands it carries, followed by
+// the text.  outbuf_head is the oldest frame.
+#define FRAME_HEADER (2 * (int)sizeof(unsigned short))
+static char outbuf[WEBSOCKET_OUTBUF_SIZE];
+static int  outbuf_head = 0;
+static int  outbuf_tail = 0;
+
+// When the commands in those frames were queued and their input event
+// happened, oldest first, so the latency stats can be taken once the
+// frame's last byte has gone to the kernel.  Real-time frames carry no
+// commands, so jumping the queue doesn't change the order of these.
+typedef struct {
+    long long queued_us;
+    long long event_us;
+} WIRE_STAMP;
+static WIRE_STAMP stamps[WEBSOCKET_MAX_STAMPS];
+static int  stamps_head = 0;
+static int  stamps_size = 0;
+static int  held_stamps = 0;            // commands in the frame noPoll is still writing
+static struct timespec stall_start;     // when the current partial write began
+static int  stalled = 0;
+
+// Real-time commands jump the queue: they are put at the front of
+// outbuf, and urgent_bytes counts how much of the front they take up.
+static int  urgent_bytes = 0;
+static int  urgent_waiting = 0;         // timing a real-time command out to the kernel
+static struct timespec urgent_start;    // when its switch press was noticed
+static long urgent_latency_us = -1;     // switch to wire time of the last one
+
+// microseconds from start to now
+static long elapsed_us( const struct timespec* start, const struct timespec* now ) {
+    return (now->tv_sec - start->tv_sec) * 1000000L + (now->tv_nsec - start->tv_nsec) / 1000;
+}
+
+// The fd that becomes readable when a connect started by
+// websocket_init() has finished, or -1 if it couldn't be created
+int websocket_connect_fd() {
+    if (connect_fd < 0) {
+        connect_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+        if (connect_fd < 0) {
+            LOG_ERRNO( "eventfd" );
+        }
+    }
+    return connect_fd;
+}
+
+// The connect thread: the TCP connect and sending the upgrade request
+static void* websocket_connect_thread( void* arg ) {
+    uint64_t one = 1;
+
+    (void)arg;
+    atomic_store_explicit( &connect_result,
+                           nopoll_conn_new (websocket_ctx, connect_host, connect_port, NULL, "/ws", NULL, NULL),
+                           memory_order_release );
+    if (write( connect_fd, &one, sizeof(one) ) != sizeof(one)) {
+        // only fails if the counter would overflow
+    }
+    return NULL;
+}
+
+// Start connecting to SPJS, on the connect thread.  When connect_fd
+// becomes readable the caller calls websocket_connected(), then
+// watches websocket_socket() and calls websocket_handshake() until
+// the connection is ready.  Any earlier connection is closed first;
+// a connect still under way from before is waited for instead of
+// starting another.  Returns 0, or 1 if it failed.
 int websocket_init( const char* hoststr, const char* portstr ) {
-    int ret_code = 0;
-    noPollCtx * ctx = nopoll_ctx_new ();
+    pthread_attr_t attr;
+    pthread_t tid;
+    int err;
+
+    websocket_close();
+    if (websocket_connect_fd() < 0)
+        return 1;
+
+    // one context lives for the whole run, every connection shares it
+    if (! websocket_ctx) {
+        websocket_ctx = nopoll_ctx_new ();
+        if (! websocket_ctx) {
+            LOG_ERROR( "Could not create noPoll websocket context" );
+            return 1;
+        }
+        //nopoll_log_enable(websocket_ctx, nopoll_true);
+        nopoll_conn_connect_timeout (websocket_ctx, WEBSOCKET_CONNECT_US);
+    }
+
+    connect_wanted = 1;
+    if (connect_running)
+        return 0;
+    snprintf( connect_host, sizeof(connect_host), "%s", hoststr );
+    snprintf( connect_port, sizeof(connect_port), "%s", portstr );
+
+    pthread_attr_init( &attr );
+    pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+    err = pthread_create( &tid, &attr, websocket_connect_thread, NULL );
+    pthread_attr_destroy( &attr );
+    if (err) {
+        LOG_ERROR( "Could not start the connect thread: %s", strerror( err ) );
+        connect_wanted = 0;
+        return 1;
+    }
+    connect_running = 1;
+    return 0;
+}
+
+// The connect thread has finished.  Returns 1 if the connection is
+// up and the handshake can go on, 0 if it is no longer wanted (it has
+// been closed again), or -1 if it failed.
+int websocket_connected() {
+    uint64_t count;
+    noPollConn* conn;
+
+    if (read( connect_fd, &count, sizeof(count) ) != sizeof(count))
+        return 0;                               // woken without a result
+    connect_running = 0;
+    conn = atomic_exchange_explicit( &connect_result, NULL, memory_order_acquire );
+    if (! connect_wanted) {
+        nopoll_conn_close (conn);
+        return 0;
+    }
+    connect_wanted = 0;
+    if (! nopoll_conn_is_ok (conn)) {
+        LOG_DEBUG( "Could not connect to %s:%s", connect_host, connect_port );
+        nopoll_conn_close (conn);
+        return -1;
+    }
+    websocket_conn = conn;
+
+    // From here on the event loop only touches the socket when it is
+    // ready, so reads must never block on a partial frame.
+    nopoll_conn_set_sock_block( nopoll_conn_socket (websocket_conn), nopoll_false );
+    return 1;
+}
+
+// Close the connection to SPJS, if there is one, and throw away
+// whatever was still buffered for it.  A connect still under way is
+// closed when it reports back.  The caller must have stopped watching
+// websocket_socket() already.
+void websocket_close() {
+    connect_wanted = 0;
+    if (websocket_conn) {
+        nopoll_conn_close (websocket_conn);
+        websocket_conn = NULL;
+    }
+    outbuf_head = outbuf_tail = 0;
+    stamps_head = stamps_size = held_stamps = 0;
+    stalled = 0;
+    urgent_bytes = 0;
+    urgent_waiting = 0;
+}
+
+// Carry on with the opening handshake when the socket is readable.
+// noPoll reads SPJS's reply to the upgrade request as part of the next
+// read.  Returns 1 once the connection is ready, 0 while still waiting
+// and -1 if it failed.
+int websocket_handshake() {
+    noPollMsg* msg;
 
-    if (! ctx) {
-        fprintf(stderr, "ERROR: Could not create noPoll websocket context\n");
-        ret_code = 1;
-        goto cleanup;
+    if (! nopoll_conn_is_ready (websocket_conn)) {
+        msg = nopoll_conn_get_msg (websocket_conn);
+        if (msg) {
+            nopoll_msg_unref (msg);
+        }
     }
-    //nopoll_log_enable(ctx, nopoll_true);
+    if (! nopoll_conn_is_ok (websocket_conn))
+        return -1;
+    return nopoll_conn_is_ready (websocket_conn) ? 1 : 0;
+}
+
+// Build the frame prefixes for commands to the serial port device.
+// Returns 1 if the name is too long.
+int websocket_port_init( WEBSOCKET_PORT* port, const char* device ) {
+    if (strlen( device ) >= MAX_CMD_LENGTH) {
+        LOG_ERROR( "Device path too long: %s", device );
+        return 1;
+    }
+    port->send_len      = sprintf( port->send_prefix, "send %s ", device );
+    port->sendjson_len  = sprintf( port->sendjson_prefix, "sendjson {\"P\":\"%s\",\"Data\":[", device );
+    port->sendnobuf_len = sprintf( port->sendnobuf_prefix, "sendnobuf %s ", device );
+    return 0;
+}
+
+// The socket underneath the websocket, so it can be watched by the event loop
+int websocket_socket() {
+    if (! websocket_conn)
+        return -1;
+    return nopoll_conn_socket (websocket_conn);
+}
+
+// Read everything SPJS has sent us, passing each message to handler
+// (which may be NULL to just discard them).  Returns -1 if the
+// connection has gone away.
+int websocket_read_msgs( WEBSOCKET_MSG_HANDLER handler ) {
+    noPollMsg* msg;
 
-    // call to create a connection
-    websocket_conn = nopoll_conn_new (ctx, hoststr, portstr, NULL, "/ws", NULL, NULL);
+    while ((msg = nopoll_conn_get_msg (websocket_conn)) != NULL) {
+        if (handler) {
+            handler( (const char*) nopoll_msg_get_payload (msg), nopoll_msg_get_payload_size (msg) );
+        }
+        nopoll_msg_unref (msg);
+    }
     if (! nopoll_conn_is_ok (websocket_conn)) {
-        fprintf(stderr, "ERROR: Could not connect to %s:%s\n", hoststr, portstr);
-        ret_code = 1;
-        goto cleanup;
+        LOG_ERROR( "Websocket connection closed" );
+        return -1;
     }
+    return 0;
+}
+
+// The n oldest commands have reached the kernel
+static void record_wire_stamps( int n ) {
+    long long now_us = stats_now_us();
+    WIRE_STAMP* stamp;
 
-    if (! nopoll_conn_wait_until_connection_ready (websocket_conn, 5)) {
-        fprintf(stderr, "ERROR: Timed out waiting for connection to become ready\n");
-        ret_code = 1;
-        goto cleanup;
+    for (; n > 0; n--) {
+        stamp = &stamps[stamps_head];
+        stats_record( STATS_QUEUE_TO_WIRE, now_us - stamp->queued_us );
+        if (stamp->event_us) {
+            stats_record( STATS_EVENT_TO_WIRE, now_us - stamp->event_us );
+        }
+        stamps_head = (stamps_head + 1) % WEBSOCKET_MAX_STAMPS;
+        stamps_size--;
     }
+}
 
-cleanup:
-    if (ctx) nopoll_ctx_unref (ctx);
-    return ret_code;
+// Hand buffered frames to noPoll until they are all gone or the socket
+// won't take any more.  noPoll keeps the unsent tail of a partial write
+// itself; we finish that off first when the socket becomes writable.
+// Returns -1 if the connection failed or has been stuck for too long.
+int websocket_flush() {
+    unsigned short len, num_cmds;
+    int pending, ret;
+    struct timespec now;
+
+    if (nopoll_conn_pending_write_bytes (websocket_conn) > 0) {
+        nopoll_conn_complete_pending_write (websocket_conn);
+    }
+    if (held_stamps && nopoll_conn_pending_write_bytes (websocket_conn) == 0) {
+        record_wire_stamps( held_stamps );
+        held_stamps = 0;
+    }
+
+    while (nopoll_conn_pending_write_bytes (websocket_conn) == 0 && outbuf_head < outbuf_tail) {
+        memcpy( &len, outbuf + outbuf_head, sizeof(len) );
+        memcpy( &num_cmds, outbuf + outbuf_head + sizeof(len), sizeof(num_cmds) );
+        ret = nopoll_conn_send_text (websocket_conn, outbuf + outbuf_head + FRAME_HEADER, len);
+        if (ret < 0 && nopoll_conn_pending_write_bytes (websocket_conn) == 0) {
+            LOG_ERROR( "Websocket send failed" );
+            return -1;
+        }
+        outbuf_head += FRAME_HEADER + len;
+        if (urgent_bytes > 0) {
+            urgent_bytes -= FRAME_HEADER + len;
+        }
+        // the loop stops here if noPoll kept part of it back
+        if (nopoll_conn_pending_write_bytes (websocket_conn) == 0) {
+            record_wire_stamps( num_cmds );
+        } else {
+            held_stamps = num_cmds;
+        }
+    }
+    if (outbuf_head == outbuf_tail) {
+        outbuf_head = outbuf_tail = 0;
+    }
+
+    if (! nopoll_conn_is_ok (websocket_conn)) {
+        LOG_ERROR( "Websocket connection closed" );
+        return -1;
+    }
+
+    pending = nopoll_conn_pending_write_bytes (websocket_conn);
+    if (pending == 0) {
+        stalled = 0;
+        if (urgent_waiting && urgent_bytes == 0) {
+            clock_gettime( CLOCK_MONOTONIC, &now );
+            urgent_latency_us = elapsed_us( &urgent_start, &now );
+            urgent_waiting = 0;
+            LOG_INFO( "Real-time command on the wire %ld us after the switch", urgent_latency_us );
+            stats_record( STATS_REALTIME_TO_WIRE, urgent_latency_us );
+        }
+        return 0;
+    }
+
+    // partial write: wait for the socket to become writable, but give
+    // up on the connection if it doesn't drain in a reasonable time.
+    if (!stalled) {
+        LOG_WARN( "Partial websocket write, %d bytes pending", pending );
+        clock_gettime( CLOCK_MONOTONIC, &stall_start );
+        stalled = 1;
+    } else if (websocket_stall_left_us() == 0) {
+        LOG_ERROR( "Websocket write stalled with %d bytes pending", pending );
+        return -1;
+    }
+    return 0;
 }
 
-int websocket_write( const char* cmdstr ) {
-    int bytes_written = 0;
+// How much longer a partial write may take to drain before the
+// connection counts as dead: 0 once it has taken too long, -1 if
+// nothing is stuck.  websocket_flush() only runs when the socket turns
+// writable or there is more to send, so a peer that stops reading has
+// to be caught by the caller checking this on a timer.
+long websocket_stall_left_us() {
+    struct timespec now;
+    long waited_us;
+
+    if (!stalled)
+        return -1;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    waited_us = elapsed_us( &stall_start, &now );
+    return waited_us >= WEBSOCKET_STALL_US ? 0 : WEBSOCKET_STALL_US - waited_us;
+}
+
+// True while there is output that needs the socket to become writable
+int websocket_want_write() {
+    return stalled || outbuf_head < outbuf_tail;
+}
+
+// Bytes accepted by websocket_write() that haven't reached the kernel yet
+int websocket_pending_bytes() {
+    if (! websocket_conn)
+        return 0;
+    return (outbuf_tail - outbuf_head) + nopoll_conn_pending_write_bytes (websocket_conn);
+}
+
+// Queue a frame carrying the num_cmds commands at the head of queue for
+// sending, and push out as much as the socket will take without
+// blocking.  The commands stay on the queue; only their timestamps are
+// kept.  Returns the number of bytes accepted, or -1 if the outbound
+// buffer is full or the connection has failed.
+int websocket_write( const char* cmdstr, Queue* queue, int num_cmds ) {
+    unsigned short len, cmds = num_cmds;
     int cmd_length = 0;
+    QueueEntry* e;
+    int i;
 
-    // do write operation
-    fprintf(stderr, "Sending websocket cmd: %s\n", cmdstr);
+    LOG_TRACE( "Sending websocket cmd: %s", cmdstr );
     cmd_length = strlen( cmdstr );
-    bytes_written = nopoll_conn_send_text (websocket_conn, cmdstr, cmd_length);
 
-    // complete pending write by flushing and limitting operation for 2 seconds
-    bytes_written = nopoll_conn_flush_writes (websocket_conn, 2000000, bytes_written);
+    if (stamps_size + num_cmds > WEBSOCKET_MAX_STAMPS) {
+        LOG_ERROR( "Websocket output buffer full, %d commands pending", stamps_size );
+        return -1;
+    }
+    if (outbuf_tail + FRAME_HEADER + cmd_length > WEBSOCKET_OUTBUF_SIZE) {
+        // make room by moving the unsent frames to the front
+        memmove( outbuf, outbuf + outbuf_head, outbuf_tail - outbuf_head );
+        outbuf_tail -= outbuf_head;
+        outbuf_head  = 0;
+        if (outbuf_tail + FRAME_HEADER + cmd_length > WEBSOCKET_OUTBUF_SIZE) {
+            LOG_ERROR( "Websocket output buffer full, %d bytes pending", websocket_pending_bytes() );
+            return -1;
+        }
+    }
+    len = cmd_length;
+    memcpy( outbuf + outbuf_tail, &len, sizeof(len) );
+    memcpy( outbuf + outbuf_tail + sizeof(len), &cmds, sizeof(cmds) );
+    memcpy( outbuf + outbuf_tail + FRAME_HEADER, cmdstr, cmd_length );
+    outbuf_tail += FRAME_HEADER + cmd_length;
+    for (i = 0; i < num_cmds; i++) {
+        e = queue->at( queue, i );
+        stamps[(stamps_head + stamps_size) % WEBSOCKET_MAX_STAMPS].queued_us = e->queued_us;
+        stamps[(stamps_head + stamps_size) % WEBSOCKET_MAX_STAMPS].event_us  = e->event_us;
+        stamps_size++;
+    }
 
-    return bytes_written;
+    if (websocket_flush())
+        return -1;
+    return cmd_length;
 }
 
-int websocket_send_cmds( Queue* queue ) {
-    int num_sent = 0;
-    unsigned int bytes_written = 0;
+// Send a real-time command ahead of everything still buffered.  It can
+// only overtake whole frames: one noPoll has already started on has to
+// finish first.  detected is when the switch press was noticed, so the
+// time until the frame reaches the kernel can be measured.  Returns the
+// number of bytes accepted, or -1 on failure.
+int websocket_write_urgent( const char* cmdstr, const struct timespec* detected ) {
+    unsigned short len, no_cmds = 0;
+    int cmd_length = strlen( cmdstr );
+    int frame_length = FRAME_HEADER + cmd_length;
+    int buffered = outbuf_tail - outbuf_head;
+
+    LOG_DEBUG( "Sending real-time websocket cmd: %s", cmdstr );
+    if (buffered + frame_length > WEBSOCKET_OUTBUF_SIZE) {
+        LOG_ERROR( "Websocket output buffer full, %d bytes pending", websocket_pending_bytes() );
+        return -1;
+    }
+
+    // slide the ordinary frames up to make room behind any earlier
+    // real-time commands, which must keep their order
+    memmove( outbuf, outbuf + outbuf_head, urgent_bytes );
+    memmove( outbuf + urgent_bytes + frame_length, outbuf + outbuf_head + urgent_bytes, buffered - urgent_bytes );
+    len = cmd_length;
+    memcpy( outbuf + urgent_bytes, &len, sizeof(len) );
+    memcpy( outbuf + urgent_bytes + sizeof(len), &no_cmds, sizeof(no_cmds) );
+    memcpy( outbuf + urgent_bytes + FRAME_HEADER, cmdstr, cmd_length );
+    outbuf_head   = 0;
+    outbuf_tail   = buffered + frame_length;
+    urgent_bytes += frame_length;
+
+    if (!urgent_waiting) {
+        urgent_start   = *detected;
+        urgent_waiting = 1;
+    }
+
+    if (websocket_flush())
+        return -1;
+    return cmd_length;
+}
+
+// Send a GRBL/TinyG real-time command (feed hold, resume, reset, jog
+// cancel), at most WEBSOCKET_MAX_REALTIME bytes.  SPJS's "sendnobuf"
+// writes it straight to the serial port instead of queueing it behind
+// the lines SPJS is still feeding the controller.  It goes out bare:
+// a newline after it would be an empty line, which GRBL answers with
+// an "ok" that nobody is waiting for.
+int websocket_send_realtime( const WEBSOCKET_PORT* port, const char* cmd, const struct timespec* detected ) {
+    char frame[sizeof(port->sendnobuf_prefix) + WEBSOCKET_MAX_REALTIME + 1];
+    int len = strnlen( cmd, WEBSOCKET_MAX_REALTIME );
+
+    memcpy( frame, port->sendnobuf_prefix, port->sendnobuf_len );
+    memcpy( frame + port->sendnobuf_len, cmd, len );
+    frame[port->sendnobuf_len + len] = '\0';
+    return websocket_write_urgent( frame, detected ) < 0 ? -1 : 0;
+}
+
+// How long the last real-time command took from its switch press to
+// the kernel, in microseconds, or -1 if none has been sent yet.
+long websocket_realtime_latency_us() {
+    return urgent_latency_us;
+}
+
+// Send one complete SPJS command frame that carries the num_cmds
+// commands at the head of the queue, and take them off it once the
+// frame is accepted.  Their latency is recorded when the frame reaches
+// the kernel.  Returns the number of commands that went out.
+static int websocket_send_frame( Queue* queue, const char* frame, int num_cmds ) {
+    int bytes_written = websocket_write( frame, queue, num_cmds );
+    CMD_TYPE type;
     char cmd[MAX_CMD_LENGTH];
+    int i;
 
-    if (queue->size == 0)
+    if (bytes_written != (int)strlen(frame)) {
+        LOG_ERROR( "Only sent %d bytes of command: %s", bytes_written, frame );
         return 0;
-    else { 
-        while (queue->size > 0) {
-            queue->pop( queue, cmd );
-            bytes_written = websocket_write( cmd );
-            if (bytes_written != strlen(cmd)) {
-                fprintf(stderr, "ERROR: Only sent %d bytes of command: %s\n", bytes_written, cmd);
-            } else {
-                fprintf(stderr, "     + Successfully sent cmd: %s\n", cmd);
-                num_sent++;
-            }
+    }
+    LOG_TRACE( "     + Successfully sent cmd: %s", frame );
+    stats_count( STATS_CMDS_SENT, num_cmds );
+    for (i = 0; i < num_cmds; i++) {
+        queue->pop( queue, &type, cmd );
+    }
+    return num_cmds;
+}
+
+// Append str to a sendjson frame with JSON string escaping
+static int json_escape( char* dst, const char* str ) {
+    int len = 0;
+
+    for (; *str; str++) {
+        switch (*str) {
+            case '\n': dst[len++] = '\\'; dst[len++] = 'n';  break;
+            case '"':  dst[len++] = '\\'; dst[len++] = '"';  break;
+            case '\\': dst[len++] = '\\'; dst[len++] = '\\'; break;
+            default:
+                if ((unsigned char)*str < 0x20) {
+                    len += sprintf( dst + len, "\\u%04x", (unsigned char)*str );
+                } else {
+                    dst[len++] = *str;
+                }
+                break;
         }
     }
-    fprintf(stderr, "Sent %d commands\n", num_sent);
-    return num_sent;
+    return len;
 }
 
+// Close off the batch being built in frame and send it
+static int websocket_send_batch( Queue* queue, char* frame, int frame_len, int frame_cmds, BATCH_MODE batch_mode ) {
+    if (batch_mode == BATCH_SENDJSON) {
+        strcpy( frame + frame_len, "]}" );
+    } else {
+        frame[frame_len] = '\0';
+    }
+    return websocket_send_frame( queue, frame, frame_cmds );
+}
 
-int http_send_cmds( Queue* queue ) {
+// Empty the queue into SPJS, addressed to port.  Broadcasts always get a frame of their
+// own.  G-code for the controller is either sent one "send" frame per
+// command, or with batching, everything queued back to back goes out
+// as a single multi-line "send" or "sendjson" frame so SPJS sees a few
+// larger writes instead of a stream of tiny ones.  Commands only leave
+// the queue once their frame has been accepted, so if one fails the
+// rest stay queued rather than being written to a dead connection.
+int websocket_send_cmds( Queue* queue, const WEBSOCKET_PORT* port, BATCH_MODE batch_mode ) {
+    static unsigned int json_id = 0;
     int num_sent = 0;
-    char cmd[MAX_CMD_LENGTH];
+    char entry[6*MAX_CMD_LENGTH + 32];      // worst case JSON escaping
+    char frame[WEBSOCKET_MAX_FRAME];
+    int frame_len = 0, frame_cmds = 0, entry_len;
+    QueueEntry* e;
 
     if (queue->size == 0)
         return 0;
-    else { 
-        while (queue->size > 0) {
-            queue->pop( queue, cmd );
 
-            CURL *curl;
-            CURLcode res;
+    // the frame being built holds the first frame_cmds entries
+    while (queue->size > frame_cmds) {
+        e = queue->at( queue, frame_cmds );
 
-            curl = curl_easy_init();
-            if(curl) {
-
-                // Set the URL for the http GET
-                curl_easy_setopt(curl, CURLOPT_URL, cmd);
+        if (e->type == CMD_BROADCAST || batch_mode == BATCH_NONE) {
+            if (frame_cmds) {
+                if (! websocket_send_batch( queue, frame, frame_len, frame_cmds, batch_mode ))
+                    return num_sent;
+                num_sent  += frame_cmds;
+                frame_cmds = 0;
+            }
+            if (e->type == CMD_BROADCAST) {
+                snprintf( frame, sizeof(frame), "broadcast %s\n", e->cmd );
+            } else {
+                memcpy( frame, port->send_prefix, port->send_len );
+                strcpy( frame + port->send_len, e->cmd );
+            }
+            if (! websocket_send_frame( queue, frame, 1 ))
+                return num_sent;
+            num_sent++;
+            continue;
+        }
 
-                /* Perform the request, res will get the return code */
-                res = curl_easy_perform(curl);
-                /* Check for errors */
-                if(res != CURLE_OK) {
-                  fprintf(stderr, "curl_easy_perform() failed: %s %s\n",
-                          curl_easy_strerror(res), cmd);
-                } else {
-                    fprintf(stderr, "     + Successfully sent cmd: %s\n", cmd);
-                    num_sent++;
-                }
+        if (batch_mode == BATCH_SENDJSON) {
+            entry_len  = sprintf( entry, "{\"D\":\"" );
+            entry_len += json_escape( entry + entry_len, e->cmd );
+            entry_len += sprintf( entry + entry_len, "\",\"Id\":\"scp%u\"}", ++json_id );
+        } else {
+            entry_len = snprintf( entry, sizeof(entry), "%s", e->cmd );
+        }
 
-                /* always cleanup */
-                curl_easy_cleanup(curl);
+        // leave room for a separating comma and the closing "]}"
+        if (frame_cmds && frame_len + entry_len + 4 > WEBSOCKET_MAX_FRAME) {
+            if (! websocket_send_batch( queue, frame, frame_len, frame_cmds, batch_mode ))
+                return num_sent;
+            num_sent  += frame_cmds;
+            frame_cmds = 0;
+        }
+        if (frame_cmds == 0) {
+            if (batch_mode == BATCH_SENDJSON) {
+                memcpy( frame, port->sendjson_prefix, port->sendjson_len );
+                frame_len = port->sendjson_len;
             } else {
-                fprintf(stderr, "Failed to establish curl instance\n");
+                memcpy( frame, port->send_prefix, port->send_len );
+                frame_len = port->send_len;
             }
+        } else if (batch_mode == BATCH_SENDJSON) {
+            frame[frame_len++] = ',';
         }
+        memcpy( frame + frame_len, entry, entry_len );
+        frame_len += entry_len;
+        frame_cmds++;
+    }
+    if (frame_cmds) {
+        num_sent += websocket_send_batch( queue, frame, frame_len, frame_cmds, batch_mode );
     }
 
-    fprintf(stderr, "Sent %d commands\n", num_sent);
+    LOG_DEBUG( "Sent %d commands", num_sent );
     return num_sent;
-
 }
 
+
 /**
- * Push an item into queue, if this is the first item,
- * both queue->head and queue->tail will point to it,
- * otherwise the oldtail->next and tail will point to it.
+ * Push an item onto the tail of the queue.  Returns 0, or -1 if the
+ * queue is full and its policy is to reject new commands.
  */
-void push (Queue* queue, const char cmd[MAX_CMD_LENGTH]) {
-    // Create a new cmd
-    Node* n = (Node*) malloc (sizeof(Node));
-    strncpy( n->cmd, cmd, MAX_CMD_LENGTH );
-    n->next = NULL;
-
-    if (queue->head == NULL) { // no head
-        queue->head = n;
-    } else{
-        queue->tail->next = n;
-    }
-    queue->tail = n;
+int push (Queue* queue, CMD_TYPE type, const char cmd[MAX_CMD_LENGTH]) {
+    QueueEntry* e;
+    int len;
+
+    if (queue->size == QUEUE_CAPACITY) {
+        queue->dropped++;
+        stats_count( STATS_CMDS_DROPPED, 1 );
+        if (queue->policy == QUEUE_REJECT) {
+            LOG_ERROR( "Command queue full, dropping: %s", cmd );
+            return -1;
+        }
+        LOG_ERROR( "Command queue full, dropping: %s", queue->entries[queue->head].cmd );
+        queue->head = (queue->head + 1) & (QUEUE_CAPACITY - 1);
+        queue->size--;
+    }
+
+    len = strnlen( cmd, MAX_CMD_LENGTH - 1 );
+    e = &queue->entries[(queue->head + queue->size) & (QUEUE_CAPACITY - 1)];
+    e->type = type;
+    e->len  = len;
+    e->sticky = 0;
+    e->queued_us = stats_now_us();
+    e->event_us  = queue->event_us;
+    if (e->event_us) {
+        stats_record( STATS_EVENT_TO_QUEUE, e->queued_us - e->event_us );
+    }
+    memcpy( e->cmd, cmd, len );
+    e->cmd[len] = '\0';
     queue->size++;
+    stats_count( STATS_CMDS_QUEUED, 1 );
+    return 0;
 }
 /**
- * Return and remove the first cmd.
+ * Return and remove the first cmd.  Returns its length, or -1 if the
+ * queue is empty.
  */
-int pop (Queue* queue, char cmd[MAX_CMD_LENGTH]) {
-    if (queue->head == NULL) return -1;
-    // get the first cmd
-    Node* head = queue->head;
-    strncpy( cmd, head->cmd, MAX_CMD_LENGTH );
-    // move head pointer to next cmd, decrease size
-    queue->head = head->next;
+int pop (Queue* queue, CMD_TYPE* type, char cmd[MAX_CMD_LENGTH]) {
+    int len = peek( queue, type, cmd );
+
+    if (len < 0) return -1;
+    queue->head = (queue->head + 1) & (QUEUE_CAPACITY - 1);
     queue->size--;
-    // free the memory of original head
-    free(head);
-    return 0;
+    return len;
 }
 /**
  * Empty the queue.
  */
 int clear (Queue* queue) {
-    char cmd[MAX_CMD_LENGTH];
-
-    if (queue->head == NULL) return -1;
-    while (queue->size > 0) {
-        queue->pop( queue, cmd );
-    }
+    if (queue->size == 0) return -1;
+    queue->head = 0;
+    queue->size = 0;
     return 0;
 }
 /**
- * Return but not remove the first item.
+ * Return but not remove the first item.  Returns its length, or -1
+ * if the queue is empty.
  */
-int peek (Queue* queue, char cmd[MAX_CMD_LENGTH]) {
-    if (queue->head == NULL) return -1;
-    Node* head = queue->head;
-    strncpy( cmd, head->cmd, MAX_CMD_LENGTH );
-    return 0;
+int peek (Queue* queue, CMD_TYPE* type, char cmd[MAX_CMD_LENGTH]) {
+    QueueEntry* e;
+
+    if (queue->size == 0) return -1;
+    e = &queue->entries[queue->head];
+    *type = e->type;
+    memcpy( cmd, e->cmd, e->len + 1 );
+    return e->len;
+}
+/**
+ * The entry index places from the head, NULL if there isn't one.
+ */
+QueueEntry* at (Queue* queue, int index) {
+    if (index < 0 || index >= queue->size) return NULL;
+    return &queue->entries[(queue->head + index) & (QUEUE_CAPACITY - 1)];
 }
 /**
  * Show all items in queue.
@@ -178,14 +670,10 @@ void display (Queue* queue) {
     if (queue->size == 0)
         printf("No item in queue.\n");
     else { // has item(s)
-        Node* head = queue->head;
-        int i, size = queue->size;
+        int i;
         printf("%d item(s):\n", queue->size);
-        for (i = 0; i < size; i++) {
-            //if (i > 0)
-                //printf(", ");
-            printf("%s", head->cmd);
-            head = head->next;
+        for (i = 0; i < queue->size; i++) {
+            printf("%s", queue->at( queue, i )->cmd);
         }
     }
     printf("\n\n");
@@ -193,16 +681,18 @@ void display (Queue* queue) {
 /**
  * Create and initiate a Queue
  */
-Queue createQueue () {
+Queue createQueue (QUEUE_POLICY policy) {
     Queue queue;
     queue.size = 0;
-    queue.head = NULL;
-    queue.tail = NULL;
+    queue.head = 0;
+    queue.policy = policy;
+    queue.dropped = 0;
+    queue.event_us = 0;
     queue.push = &push;
     queue.pop = &pop;
     queue.clear = &clear;
     queue.peek = &peek;
+    queue.at = &at;
     queue.display = &display;
     return queue;
 }
-
@@ -2,46 +2,109 @@
 #define WEBSOCKET_H
 
 #include <nopoll.h>
-#include <curl/curl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include "stats.h"
 #define MAX_CMD_LENGTH 80
+#define WEBSOCKET_OUTBUF_SIZE 8192       // bytes of frames buffered while the socket is busy
+#define WEBSOCKET_STALL_US    2000000    // give up on a connection that can't drain for this long
+#define WEBSOCKET_MAX_FRAME   1024       // largest batched SPJS command we build
+#define WEBSOCKET_MAX_STAMPS  1024       // commands in frames buffered while the socket is busy
+#define WEBSOCKET_CONNECT_US  500000     // longest the TCP connect to SPJS may take, on its own thread
+#define WEBSOCKET_MAX_REALTIME 4         // longest real-time command, in bytes
 
-/* 
- * Note... my queue structure was borrowed from here:
- * https://github.com/benbai123/C_Cplusplus_Practice/blob/master/C_DataStructure/Queue.c
+// What a queued command is.  The queue only holds the payload; the
+// transport adds the "send <port>", "broadcast" or URL framing.
+typedef enum {
+    CMD_GCODE     = 0,   // one or more newline terminated lines for the controller
+    CMD_BROADCAST = 1,   // JSON for SPJS to broadcast to the other websocket clients
+} CMD_TYPE;
+
+// How websocket_send_cmds() packs the G-code queued in one cycle
+typedef enum {
+    BATCH_NONE     = 0,  // one "send" frame per queued command
+    BATCH_SEND     = 1,  // one "send" frame carrying all the lines
+    BATCH_SENDJSON = 2,  // one "sendjson" frame with an entry per command
+} BATCH_MODE;
+
+/*
+ * The command queue is a fixed capacity ring buffer, so queueing and
+ * sending commands never touches the heap and memory use has a hard
+ * ceiling.  Each entry stores its length so only the bytes actually
+ * used are copied.  What happens when it is full is up to the policy.
  */
+#define QUEUE_CAPACITY 128               // entries, must be a power of two
+
+typedef enum {
+    QUEUE_REJECT      = 0,   // refuse new commands while full
+    QUEUE_DROP_OLDEST = 1,   // make room by dropping the oldest command
+} QUEUE_POLICY;
+
+typedef struct {
+    CMD_TYPE type;
+    int      len;                        // strlen of cmd
+    long long event_us;                  // input event that caused it, 0 if none
+    long long queued_us;                 // when it was pushed
+    short int sticky;                    // not for the device's clear_queued_moves() to drop
+    char     cmd[MAX_CMD_LENGTH];
+} QueueEntry;
 
-typedef struct Node {
-    char cmd[MAX_CMD_LENGTH];
-    struct Node* next;
-} Node;
 /**
- * The Queue struct, contains the pointers that
- * point to first cmd and last cmd, the size of the Queue,
- * and the function pointers.
+ * The Queue struct, contains the ring of entries, the index of the
+ * oldest one, the size of the Queue, and the function pointers.
  */
 typedef struct Queue {
-    Node* head;
-    Node* tail;
-    void (*push) (struct Queue*, const char*); // add cmd to tail
-    int (*pop) (struct Queue*, char*);         // get cmd from head and remove it from queue
-    int (*clear) (struct Queue*);              // empty the queue
-    int (*peek) (struct Queue*, char*);        // get cmd from head but keep it in queue
-    void (*display) (struct Queue*);   // display all element in queue
-    int size;                          // size of this queue
+    QueueEntry entries[QUEUE_CAPACITY];
+    int head;                            // index of the oldest entry
+    int size;                            // size of this queue
+    QUEUE_POLICY policy;                 // what push does when full
+    int dropped;                         // commands lost to a full queue
+    long long event_us;                  // stamped on entries pushed while non-zero
+    int (*push) (struct Queue*, CMD_TYPE, const char*);  // add cmd to tail
+    int (*pop) (struct Queue*, CMD_TYPE*, char*);        // get cmd from head and remove it from queue
+    int (*clear) (struct Queue*);                        // empty the queue
+    int (*peek) (struct Queue*, CMD_TYPE*, char*);       // get cmd from head but keep it in queue
+    QueueEntry* (*at) (struct Queue*, int);              // entry index places from the head
+    void (*display) (struct Queue*);     // display all element in queue
 } Queue;
 
+// The frame prefixes for one serial port SPJS is talking to, built once
+// by websocket_port_init() instead of on every send
+typedef struct {
+    char send_prefix[MAX_CMD_LENGTH + 16];       // "send <port> "
+    char sendjson_prefix[MAX_CMD_LENGTH + 32];   // "sendjson {"P":"<port>","Data":["
+    char sendnobuf_prefix[MAX_CMD_LENGTH + 16];  // "sendnobuf <port> "
+    int  send_len, sendjson_len, sendnobuf_len;
+} WEBSOCKET_PORT;
+
+// Called with the payload of each message received from SPJS
+typedef void (*WEBSOCKET_MSG_HANDLER)( const char* msg, int len );
+
+int websocket_connect_fd();
 int websocket_init( const char* hoststr, const char* portstr );
-int websocket_write( const char* cmdstr );
-int websocket_send_cmds( Queue* queue );
-int http_send_cmds( Queue* queue );
-void push (Queue* queue, const char cmd[MAX_CMD_LENGTH]);
-int pop (Queue* queue, char cmd[MAX_CMD_LENGTH]);
-int peek (Queue* queue, char cmd[MAX_CMD_LENGTH]);
+int websocket_connected();
+int websocket_handshake();
+void websocket_close();
+int websocket_port_init( WEBSOCKET_PORT* port, const char* device );
+int websocket_socket();
+int websocket_read_msgs( WEBSOCKET_MSG_HANDLER handler );
+int websocket_write( const char* cmdstr, Queue* queue, int num_cmds );
+int websocket_flush();
+int websocket_want_write();
+long websocket_stall_left_us();
+int websocket_pending_bytes();
+int websocket_send_cmds( Queue* queue, const WEBSOCKET_PORT* port, BATCH_MODE batch_mode );
+int websocket_write_urgent( const char* cmdstr, const struct timespec* detected );
+int websocket_send_realtime( const WEBSOCKET_PORT* port, const char* cmd, const struct timespec* detected );
+long websocket_realtime_latency_us();
+int push (Queue* queue, CMD_TYPE type, const char cmd[MAX_CMD_LENGTH]);
+int pop (Queue* queue, CMD_TYPE* type, char cmd[MAX_CMD_LENGTH]);
+int peek (Queue* queue, CMD_TYPE* type, char cmd[MAX_CMD_LENGTH]);
+QueueEntry* at (Queue* queue, int index);
 void display (Queue* queue);
-Queue createQueue ();
+Queue createQueue (QUEUE_POLICY policy);
 
 
 #endif   /* WEBSOCKET_H - do not put anything below this line! */